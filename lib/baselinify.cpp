@@ -1,101 +1,455 @@
 #include "baselinify.h"
 
+#include "binfile.h"
+#include "jpegio.h"
 #include "madness.h"
 
-#include <jpeglib.h>
+#include <algorithm>
+#include <csetjmp>
+#include <cstring>
+#include <optional>
+#include <sstream>
+#include <utility>
+#include <vector>
 
 #define JPEG_APP1 (JPEG_APP0+1)
+#define JPEG_SOI 0xD8
+#define JPEG_SOF0 0xC0
+#define JPEG_SOF1 0xC1
+#define JPEG_SOS 0xDA
+#define JPEG_APP2 (JPEG_APP0+2)
+#define JPEG_APP14 (JPEG_APP0+14)
+#define JPEG_APP15 (JPEG_APP0+15)
+#define JPEG_COM 0xFE
+#define EXIF_ORIENTATION 0x0112
+// "Adobe", version and two flag words come first
+#define ADOBE_TRANSFORM_OFFSET 11
+// Re-encoding after scaling down, where artifacts are about a pixel on paper anyway
+#define DOWNSCALE_JPEG_QUALITY 90
 
-struct bts_source_mgr: jpeg_source_mgr
+// Orientation tag from the first IFD of EXIF data, 0 if there is none
+uint16_t exif_orientation(const uint8_t* data, size_t size)
 {
-  bts_source_mgr(Bytestream& in) : bts(in)
+  if(size < 14 || memcmp(data, "Exif\0\0", 6) != 0)
   {
-    #if MADNESS
-    LIB(jpeg, "libjpeg.so.62");
-    FUNC(jpeg, boolean, jpeg_resync_to_restart, j_decompress_ptr, int);
-    #endif
-
-    jpeg_source_mgr::init_source = init_source;
-    jpeg_source_mgr::fill_input_buffer = fill_input_buffer;
-    jpeg_source_mgr::skip_input_data = skip_input_data;
-    jpeg_source_mgr::resync_to_restart = jpeg_resync_to_restart;
-    jpeg_source_mgr::term_source = term_source;
-    jpeg_source_mgr::bytes_in_buffer = bts.size();
-    jpeg_source_mgr::next_input_byte = bts.raw();
+    return 0;
   }
-
-  static void init_source(j_decompress_ptr) {}
-
-  static boolean fill_input_buffer(j_decompress_ptr)
+  const uint8_t* tiff = data + 6;
+  size_t tiffSize = size - 6;
+  bool littleEndian = memcmp(tiff, "II", 2) == 0;
+  if(!littleEndian && memcmp(tiff, "MM", 2) != 0)
   {
-    return TRUE;
+    return 0;
   }
+  auto get16 = [tiff, littleEndian](size_t pos) -> uint16_t
+  {
+    return littleEndian ? tiff[pos] | (tiff[pos + 1] << 8) : (tiff[pos] << 8) | tiff[pos + 1];
+  };
+  auto get32 = [get16, littleEndian](size_t pos) -> uint32_t
+  {
+    return littleEndian ? get16(pos) | (get16(pos + 2) << 16) : (get16(pos) << 16) | get16(pos + 2);
+  };
 
-  static void skip_input_data(j_decompress_ptr cinfo, long numBytes)
+  size_t ifd = get32(4);
+  if(ifd > tiffSize - 2)
   {
-    bts_source_mgr* src = static_cast<bts_source_mgr*>(cinfo->src);
-    src->next_input_byte += static_cast<size_t>(numBytes);
-    src->bytes_in_buffer -= static_cast<size_t>(numBytes);
+    return 0;
   }
+  size_t entries = get16(ifd);
+  for(size_t entry = ifd + 2; entries != 0 && entry + 12 <= tiffSize; entry += 12, entries--)
+  {
+    if(get16(entry) == EXIF_ORIENTATION && get16(entry + 2) == 3) // SHORT
+    {
+      return get16(entry + 8);
+    }
+  }
+  return 0;
+}
 
-  static void term_source(j_decompress_ptr) {}
+// What is left of an application or comment segment when only keeping what affects
+// the printout: JFIF, ICC profiles, Adobe color transforms and the EXIF orientation.
+// Thumbnails, maker notes, XMP etc. are dropped.
+std::optional<Bytestream> trimmed_marker(int marker, const uint8_t* data, size_t size)
+{
+  auto startsWith = [data, size](const char* id, size_t len)
+  {
+    return size >= len && memcmp(data, id, len) == 0;
+  };
 
-  Bytestream& bts;
-};
+  if((marker == JPEG_APP0 && startsWith("JFIF\0", 5)) ||
+     (marker == JPEG_APP2 && startsWith("ICC_PROFILE\0", 12)) ||
+     (marker == JPEG_APP14 && startsWith("Adobe", 5)))
+  {
+    return Bytestream(data, size);
+  }
+  if(marker == JPEG_APP1)
+  {
+    uint16_t orientation = exif_orientation(data, size);
+    if(orientation > 1)
+    {
+      Bytestream exif;
+      exif << "Exif" << (uint16_t)0 << "MM" << (uint16_t)42 << (uint32_t)8
+           << (uint16_t)1 << (uint16_t)EXIF_ORIENTATION << (uint16_t)3 << (uint32_t)1
+           << orientation << (uint16_t)0 << (uint32_t)0;
+      return exif;
+    }
+  }
+  return {};
+}
 
-struct bts_destination_mgr: jpeg_destination_mgr
+// The saved markers that are left after trimming, with their trimmed data
+static std::vector<std::pair<int, Bytestream>> trimmed_markers(jpeg_saved_marker_ptr markers)
 {
-  bts_destination_mgr(Bytestream& out) : bts(out)
+  std::vector<std::pair<int, Bytestream>> trimmed;
+  for(jpeg_saved_marker_ptr marker = markers; marker != nullptr; marker = marker->next)
   {
-    jpeg_destination_mgr::init_destination = init_destination;
-    jpeg_destination_mgr::empty_output_buffer = empty_output_buffer;
-    jpeg_destination_mgr::term_destination = term_destination;
-    jpeg_destination_mgr::next_output_byte = buffer;
-    jpeg_destination_mgr::free_in_buffer = BS_REASONABLE_FILE_SIZE;
+    std::optional<Bytestream> data = trimmed_marker(marker->marker, marker->data, marker->data_length);
+    if(data)
+    {
+      trimmed.push_back({marker->marker, std::move(*data)});
+    }
   }
+  return trimmed;
+}
 
-  static void init_destination(j_compress_ptr) {}
+// Walks the markers up to the frame header, returning its SOFn marker (0 if none)
+// and the image size. Everything read is added to head.
+static int scan_frame_header(std::istream& in, size_t& width, size_t& height, Bytestream& head)
+{
+  int sof = 0;
+  auto get = [&in, &head]()
+  {
+    int c = in.get();
+    if(c != EOF)
+    {
+      head << (uint8_t)c;
+    }
+    return c;
+  };
 
-  static boolean empty_output_buffer(j_compress_ptr cinfo)
+  if(get() == 0xFF && get() == JPEG_SOI)
   {
-    bts_destination_mgr* dest = static_cast<bts_destination_mgr*>(cinfo->dest);
-    dest->bts.putBytes(dest->buffer, BS_REASONABLE_FILE_SIZE);
+    while(get() == 0xFF)
+    {
+      // Markers may be padded with any number of fill bytes
+      int marker = 0;
+      do
+      {
+        marker = get();
+      }
+      while(marker == 0xFF);
+
+      if(marker == EOF || marker == JPEG_SOS || marker == JPEG_EOI)
+      {
+        break;
+      }
+      // TEM and RSTn stand alone, everything else has a length
+      if(marker == 0x01 || (marker >= JPEG_RST0 && marker <= JPEG_RST0 + 7))
+      {
+        continue;
+      }
+      int high = get();
+      int low = get();
+      if(low == EOF || ((high << 8) | low) < 2)
+      {
+        break;
+      }
+      std::string segment(((high << 8) | low) - 2, '\0');
+      in.read(segment.data(), segment.size());
+      head.putBytes(segment.data(), in.gcount());
+      // DHT, JPG and DAC share the range with SOFn
+      if(marker >= JPEG_SOF0 && marker <= 0xCF &&
+         marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+      {
+        if(in.gcount() >= 5)
+        {
+          const uint8_t* frame = reinterpret_cast<const uint8_t*>(segment.data()) + 1;
+          height = (frame[0] << 8) | frame[1];
+          width = (frame[2] << 8) | frame[3];
+          sof = marker;
+        }
+        break;
+      }
+    }
+  }
+  return sof;
+}
+
+static int frame_header(const Bytestream& head, size_t& width, size_t& height)
+{
+  std::istringstream in(std::string(reinterpret_cast<const char*>(head.raw()), head.size()));
+  Bytestream discarded;
+  return scan_frame_header(in, width, height, discarded);
+}
+
+Bytestream read_jpeg_head(std::istream& in)
+{
+  size_t width = 0;
+  size_t height = 0;
+  Bytestream head;
+  scan_frame_header(in, width, height, head);
+  return head;
+}
 
-    dest->next_output_byte = dest->buffer;
-    dest->free_in_buffer = BS_REASONABLE_FILE_SIZE;
-    return TRUE;
+bool is_sequential_jpeg(const Bytestream& head)
+{
+  size_t width = 0;
+  size_t height = 0;
+  int sof = frame_header(head, width, height);
+  return sof == JPEG_SOF0 || sof == JPEG_SOF1;
+}
+
+unsigned int jpeg_downscale_eighths(const Bytestream& head, size_t width, size_t height)
+{
+  size_t imageWidth = 0;
+  size_t imageHeight = 0;
+  if(frame_header(head, imageWidth, imageHeight) == 0 || imageWidth == 0 || imageHeight == 0)
+  {
+    return 8;
   }
+  size_t imageLong = std::max(imageWidth, imageHeight);
+  size_t imageShort = std::min(imageWidth, imageHeight);
+  size_t pageLong = std::max(width, height);
+  size_t pageShort = std::min(width, height);
 
-  static void term_destination(j_compress_ptr cinfo)
+  unsigned int eighths = 1;
+  while(eighths < 8 && ((imageLong * eighths) < (pageLong * 8) ||
+                        (imageShort * eighths) < (pageShort * 8)))
   {
-    bts_destination_mgr* dest = static_cast<bts_destination_mgr*>(cinfo->dest);
-    size_t size = (BS_REASONABLE_FILE_SIZE - dest->free_in_buffer);
-    dest->bts.putBytes(dest->buffer, size);
+    eighths++;
   }
+  return eighths;
+}
+
+// libjpeg errors jump back to where they were set up to, instead of exiting
+struct jump_error_mgr: jpeg_error_mgr
+{
+  jmp_buf* jumpBuffer = nullptr;
+  char message[JMSG_LENGTH_MAX] = "";
 
-  Array<JOCTET> buffer = Array<JOCTET>(BS_REASONABLE_FILE_SIZE);
-  Bytestream& bts;
+  static void jump_back(j_common_ptr cinfo)
+  {
+    jump_error_mgr* err = static_cast<jump_error_mgr*>(cinfo->err);
+    err->format_message(cinfo, err->message);
+    longjmp(*err->jumpBuffer, 1);
+  }
 };
 
-void baselinify(Bytestream& inBts, Bytestream& outBts)
+// The Adobe marker's color transform flag for what the encoder produces
+static uint8_t adobe_transform(J_COLOR_SPACE colorSpace)
+{
+  return colorSpace == JCS_YCbCr ? 1 : colorSpace == JCS_YCCK ? 2 : 0;
+}
+
+Error downscale_jpeg(std::istream& in, const WriteFun& writeFun, unsigned int eighths,
+                     bool stripMarkers)
 {
   struct jpeg_decompress_struct srcInfo;
   struct jpeg_compress_struct dstInfo;
-  struct jpeg_error_mgr jSrcErr;
-  struct jpeg_error_mgr jDstErr;
-  jvirt_barray_ptr* coefArrays;
+  jump_error_mgr srcErr;
+  jump_error_mgr dstErr;
+  jmp_buf jumpBuffer;
 
   #if MADNESS
   #include "libfuncs_jpeg"
+  #include "libfuncs_jpeg_compress"
+  #include "libfuncs_jpeg_decode"
+  #include "libfuncs_jpeg_scale"
   #endif
 
-  srcInfo.err = jpeg_std_error(&jSrcErr);
+  // Set up ahead of setjmp, as an error jumps back past the destructors of later locals
+  stream_source_mgr srcMgr(in);
+  write_fun_destination_mgr dstMgr(writeFun, JPEG_CHUNK_SIZE);
+  std::vector<std::pair<int, Bytestream>> markers;
+  std::vector<JSAMPLE> line;
+
+  srcInfo.err = jpeg_std_error(&srcErr);
+  srcErr.error_exit = jump_error_mgr::jump_back;
+  srcErr.jumpBuffer = &jumpBuffer;
   jpeg_create_decompress(&srcInfo);
 
-  dstInfo.err = jpeg_std_error(&jDstErr);
+  dstInfo.err = jpeg_std_error(&dstErr);
+  dstErr.error_exit = jump_error_mgr::jump_back;
+  dstErr.jumpBuffer = &jumpBuffer;
   jpeg_create_compress(&dstInfo);
 
+  if(setjmp(jumpBuffer) != 0)
+  {
+    Error error(srcErr.message[0] != '\0' ? srcErr.message : dstErr.message);
+    jpeg_destroy_compress(&dstInfo);
+    jpeg_destroy_decompress(&srcInfo);
+    return error;
+  }
+
+  srcInfo.src = &srcMgr;
+
+  // Keep EXIF, ICC and Adobe data, JFIF is written anew with the scaled density
+  jpeg_save_markers(&srcInfo, JPEG_APP1, 0xFFFF);
+  jpeg_save_markers(&srcInfo, JPEG_APP2, 0xFFFF);
+  jpeg_save_markers(&srcInfo, JPEG_APP14, 0xFFFF);
+
+  jpeg_read_header(&srcInfo, TRUE);
+
+  // The IDCT produces the smaller image directly, without a full size decode
+  srcInfo.scale_num = eighths;
+  srcInfo.scale_denom = 8;
+  jpeg_start_decompress(&srcInfo);
+
+  dstInfo.image_width = srcInfo.output_width;
+  dstInfo.image_height = srcInfo.output_height;
+  dstInfo.input_components = srcInfo.output_components;
+  dstInfo.in_color_space = srcInfo.out_color_space;
+  jpeg_set_defaults(&dstInfo);
+  jpeg_set_quality(&dstInfo, DOWNSCALE_JPEG_QUALITY, TRUE);
+
+  if(srcInfo.saw_JFIF_marker && srcInfo.density_unit != 0)
+  {
+    dstInfo.density_unit = srcInfo.density_unit;
+    dstInfo.X_density = std::max<UINT16>(1, (srcInfo.X_density * eighths) / 8);
+    dstInfo.Y_density = std::max<UINT16>(1, (srcInfo.Y_density * eighths) / 8);
+  }
+
+  dstInfo.dest = &dstMgr;
+
+  if(stripMarkers)
+  {
+    markers = trimmed_markers(srcInfo.marker_list);
+  }
+  else
+  {
+    for(jpeg_saved_marker_ptr marker = srcInfo.marker_list; marker != nullptr; marker = marker->next)
+    {
+      markers.push_back({marker->marker, Bytestream(marker->data, marker->data_length)});
+    }
+  }
+  for(std::pair<int, Bytestream>& marker : markers)
+  {
+    // The image is encoded anew, so the color transform is whatever the encoder uses
+    if(marker.first == JPEG_APP14 && marker.second.size() > ADOBE_TRANSFORM_OFFSET &&
+       memcmp(marker.second.raw(), "Adobe", 5) == 0)
+    {
+      marker.second.raw()[ADOBE_TRANSFORM_OFFSET] = adobe_transform(dstInfo.jpeg_color_space);
+      dstInfo.write_Adobe_marker = FALSE;
+    }
+  }
+
+  jpeg_start_compress(&dstInfo, TRUE);
+
+  for(const std::pair<int, Bytestream>& marker : markers)
+  {
+    jpeg_write_marker(&dstInfo, marker.first, marker.second.raw(), marker.second.size());
+  }
+
+  line.resize(srcInfo.output_width * srcInfo.output_components);
+  JSAMPROW row = line.data();
+  while(srcInfo.output_scanline < srcInfo.output_height)
+  {
+    jpeg_read_scanlines(&srcInfo, &row, 1);
+    jpeg_write_scanlines(&dstInfo, &row, 1);
+  }
+
+  jpeg_finish_compress(&dstInfo);
+  jpeg_destroy_compress(&dstInfo);
+  jpeg_finish_decompress(&srcInfo);
+  jpeg_destroy_decompress(&srcInfo);
+  return dstMgr.failed ? Error("Write error") : Error();
+}
+
+struct Baselinifier::Contexts
+{
+  struct jpeg_decompress_struct srcInfo;
+  struct jpeg_compress_struct dstInfo;
+  jump_error_mgr srcErr;
+  jump_error_mgr dstErr;
+  jmp_buf jumpBuffer;
+  std::vector<std::pair<int, Bytestream>> trimmedMarkers;
+};
+
+Baselinifier::Baselinifier(bool stripMarkers, size_t maxMemory)
+: _stripMarkers(stripMarkers), _maxMemory(maxMemory)
+{}
+
+Baselinifier::~Baselinifier()
+{
+  #if MADNESS
+  LIB(jpeg, "libjpeg.so.62");
+  FUNC(jpeg, void, jpeg_destroy_compress, j_compress_ptr);
+  FUNC(jpeg, void, jpeg_destroy_decompress, j_decompress_ptr);
+  #endif
+
+  if(_contexts)
+  {
+    jpeg_destroy_compress(&_contexts->dstInfo);
+    jpeg_destroy_decompress(&_contexts->srcInfo);
+  }
+}
+
+Error Baselinifier::baselinify(Bytestream& inBts, Bytestream& outBts)
+{
+  WriteFun appendFun([&outBts](Bytestream&& data)
+  {
+    outBts << data;
+    return true;
+  });
   bts_source_mgr srcMgr(inBts);
+  write_fun_destination_mgr dstMgr(appendFun, BS_REASONABLE_FILE_SIZE);
+  return transcode(srcMgr, dstMgr);
+}
+
+Error Baselinifier::baselinify(std::istream& in, const WriteFun& writeFun)
+{
+  stream_source_mgr srcMgr(in);
+  write_fun_destination_mgr dstMgr(writeFun, JPEG_CHUNK_SIZE);
+  Error error = transcode(srcMgr, dstMgr);
+  if(!error && dstMgr.failed)
+  {
+    error = "Write error";
+  }
+  return error;
+}
+
+Error Baselinifier::transcode(jpeg_source_mgr& srcMgr, jpeg_destination_mgr& dstMgr)
+{
+  #if MADNESS
+  #include "libfuncs_jpeg"
+  #include "libfuncs_jpeg_compress"
+  #include "libfuncs_jpeg_transcode"
+  #endif
+
+  if(!_contexts)
+  {
+    _contexts = std::make_unique<Contexts>();
+    _contexts->srcInfo.err = jpeg_std_error(&_contexts->srcErr);
+    _contexts->srcErr.error_exit = jump_error_mgr::jump_back;
+    _contexts->srcErr.jumpBuffer = &_contexts->jumpBuffer;
+    jpeg_create_decompress(&_contexts->srcInfo);
+
+    _contexts->dstInfo.err = jpeg_std_error(&_contexts->dstErr);
+    _contexts->dstErr.error_exit = jump_error_mgr::jump_back;
+    _contexts->dstErr.jumpBuffer = &_contexts->jumpBuffer;
+    jpeg_create_compress(&_contexts->dstInfo);
+
+    if(_maxMemory != 0)
+    {
+      // Coefficients beyond this go to libjpeg's backing store (temporary files)
+      _contexts->srcInfo.mem->max_memory_to_use = static_cast<long>(_maxMemory);
+    }
+  }
+
+  struct jpeg_decompress_struct& srcInfo = _contexts->srcInfo;
+  struct jpeg_compress_struct& dstInfo = _contexts->dstInfo;
+
+  if(setjmp(_contexts->jumpBuffer) != 0)
+  {
+    // Start over with new contexts rather than trusting what is left after an error
+    Error error(_contexts->srcErr.message[0] != '\0' ? _contexts->srcErr.message
+                                                      : _contexts->dstErr.message);
+    jpeg_destroy_compress(&dstInfo);
+    jpeg_destroy_decompress(&srcInfo);
+    _contexts.reset();
+    return error;
+  }
+
   srcInfo.src = &srcMgr;
 
   // Preserve JFIF and EXIF data
@@ -104,7 +458,7 @@ void baselinify(Bytestream& inBts, Bytestream& outBts)
 
   jpeg_read_header(&srcInfo, TRUE);
 
-  coefArrays = jpeg_read_coefficients(&srcInfo);
+  jvirt_barray_ptr* coefArrays = jpeg_read_coefficients(&srcInfo);
 
   jpeg_copy_critical_parameters(&srcInfo, &dstInfo);
 
@@ -112,18 +466,106 @@ void baselinify(Bytestream& inBts, Bytestream& outBts)
   dstInfo.write_JFIF_header = FALSE;
   dstInfo.write_Adobe_marker = FALSE;
 
-  bts_destination_mgr dstMgr(outBts);
   dstInfo.dest = &dstMgr;
 
+  // Kept in the contexts, as an error jumps back past the destructors of locals
+  _contexts->trimmedMarkers.clear();
+  if(_stripMarkers)
+  {
+    _contexts->trimmedMarkers = trimmed_markers(srcInfo.marker_list);
+  }
+
   jpeg_write_coefficients(&dstInfo, coefArrays);
 
-  for(jpeg_saved_marker_ptr marker = srcInfo.marker_list; marker != nullptr; marker = marker->next)
+  if(!_stripMarkers)
   {
-    jpeg_write_marker(&dstInfo, marker->marker, marker->data, marker->data_length);
+    for(jpeg_saved_marker_ptr marker = srcInfo.marker_list; marker != nullptr; marker = marker->next)
+    {
+      jpeg_write_marker(&dstInfo, marker->marker, marker->data, marker->data_length);
+    }
+  }
+  for(const std::pair<int, Bytestream>& marker : _contexts->trimmedMarkers)
+  {
+    jpeg_write_marker(&dstInfo, marker.first, marker.second.raw(), marker.second.size());
   }
 
+  // Both go back to idle, ready for the next image
   jpeg_finish_compress(&dstInfo);
-  jpeg_destroy_compress(&dstInfo);
   jpeg_finish_decompress(&srcInfo);
-  jpeg_destroy_decompress(&srcInfo);
+  return Error();
+}
+
+void baselinify(Bytestream& inBts, Bytestream& outBts)
+{
+  Baselinifier().baselinify(inBts, outBts);
+}
+
+Error baselinify(std::istream& in, const WriteFun& writeFun, bool stripMarkers, size_t maxMemory)
+{
+  return Baselinifier(stripMarkers, maxMemory).baselinify(in, writeFun);
+}
+
+void strip_jpeg_markers(std::istream& in, const WriteFun& writeFun)
+{
+  Bytestream header;
+  if(in.get() != 0xFF || in.get() != JPEG_SOI)
+  {
+    return;
+  }
+  header << (uint8_t)0xFF << (uint8_t)JPEG_SOI;
+
+  // Anything unexpected ends the header, and is passed on with the rest
+  while(in.peek() == 0xFF)
+  {
+    in.get();
+    int marker = 0;
+    do
+    {
+      marker = in.get();
+    }
+    while(marker == 0xFF);
+
+    if(marker == EOF)
+    {
+      break;
+    }
+    if(marker == JPEG_SOS || marker == JPEG_EOI)
+    {
+      header << (uint8_t)0xFF << (uint8_t)marker;
+      break;
+    }
+    if(marker == 0x01 || (marker >= JPEG_RST0 && marker <= JPEG_RST0 + 7))
+    {
+      header << (uint8_t)0xFF << (uint8_t)marker;
+      continue;
+    }
+
+    uint16_t length = (in.get() << 8);
+    length |= in.get();
+    if(!in || length < 2)
+    {
+      break;
+    }
+    Bytestream segment(in, length - 2);
+    if((marker >= JPEG_APP0 && marker <= JPEG_APP15) || marker == JPEG_COM)
+    {
+      std::optional<Bytestream> trimmed = trimmed_marker(marker, segment.raw(), segment.size());
+      if(trimmed)
+      {
+        header << (uint8_t)0xFF << (uint8_t)marker << (uint16_t)(trimmed->size() + 2) << *trimmed;
+      }
+    }
+    else
+    {
+      header << (uint8_t)0xFF << (uint8_t)marker << length << segment;
+    }
+  }
+
+  if(!writeFun(std::move(header)))
+  {
+    return;
+  }
+
+  // Entropy-coded data and whatever follows is passed on as-is
+  write_in_chunks(in, writeFun, JPEG_CHUNK_SIZE);
 }
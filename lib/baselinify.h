@@ -2,7 +2,63 @@
 #define BASELINIFY_H
 
 #include "bytestream.h"
+#include "error.h"
+#include "functions.h"
+
+#include <istream>
+#include <memory>
+
+struct jpeg_source_mgr;
+struct jpeg_destination_mgr;
+
+// Reads the markers up to and including the frame header. Streams like pipes can not
+// seek back, so this is to be passed on ahead of the rest, e.g. with PrefixedInStream.
+Bytestream read_jpeg_head(std::istream& in);
+
+// True for baseline and other sequential Huffman-coded JPEGs
+bool is_sequential_jpeg(const Bytestream& head);
+
+// Eighths to scale by for the image to still cover width x height pixels,
+// in either orientation. 8 means it is not larger than needed.
+unsigned int jpeg_downscale_eighths(const Bytestream& head, size_t width, size_t height);
+
+// Decodes at eighths/8 of the size using libjpeg's DCT scaling, and encodes as baseline
+Error downscale_jpeg(std::istream& in, const WriteFun& writeFun, unsigned int eighths,
+                     bool stripMarkers = false);
+
+// Passes the JPEG on unchanged, except that application and comment segments are
+// trimmed to what affects the printout (JFIF, ICC, Adobe and the EXIF orientation)
+void strip_jpeg_markers(std::istream& in, const WriteFun& writeFun);
+
+// Baselinifies one JPEG after another, keeping the libjpeg contexts in between.
+// Errors are returned instead of ending the process. Use one per thread.
+class Baselinifier
+{
+public:
+  Baselinifier(const Baselinifier&) = delete;
+  Baselinifier& operator=(const Baselinifier&) = delete;
+
+  Baselinifier(bool stripMarkers = false, size_t maxMemory = 0);
+  ~Baselinifier();
+
+  Error baselinify(Bytestream& inBts, Bytestream& outBts);
+  Error baselinify(std::istream& in, const WriteFun& writeFun);
+
+private:
+  struct Contexts;
+
+  Error transcode(jpeg_source_mgr& srcMgr, jpeg_destination_mgr& dstMgr);
+
+  bool _stripMarkers;
+  size_t _maxMemory;
+  std::unique_ptr<Contexts> _contexts;
+};
 
 void baselinify(Bytestream& inBts, Bytestream& outBts);
 
+// Reads and writes in chunks, so only the coefficients are held in memory.
+// A non-zero maxMemory caps those too, but needs a libjpeg with a backing store.
+Error baselinify(std::istream& in, const WriteFun& writeFun, bool stripMarkers = false,
+                 size_t maxMemory = 0);
+
 #endif //BASELINIFY_H
@@ -1,10 +1,23 @@
 #ifndef BINFILE_H
 #define BINFILE_H
 
+#include "array.h"
+#include "bytestream.h"
+#include "functions.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <string>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
 class InBinFile
 {
 public:
@@ -51,6 +64,132 @@ private:
   std::istream* in;
 };
 
+// Reads prefix and then carries on with in. For putting back what was read to look at
+// the start of a stream that can not seek, like a pipe.
+class PrefixedInStream : public std::istream
+{
+public:
+  PrefixedInStream() = delete;
+  PrefixedInStream(const PrefixedInStream&) = delete;
+  PrefixedInStream& operator=(const PrefixedInStream&) = delete;
+
+  PrefixedInStream(Bytestream prefix, std::istream& in)
+  : std::istream(nullptr), _buf(std::move(prefix), in)
+  {
+    rdbuf(&_buf);
+  }
+
+private:
+  class PrefixedBuf : public std::streambuf
+  {
+  public:
+    PrefixedBuf(Bytestream prefix, std::istream& in) : _prefix(std::move(prefix)), _in(in)
+    {
+      char* start = reinterpret_cast<char*>(_prefix.raw());
+      setg(start, start, start + _prefix.size());
+    }
+
+  protected:
+    int_type underflow() override
+    {
+      if(gptr() == egptr())
+      {
+        _in.read(_chunk, sizeof(_chunk));
+        if(_in.gcount() == 0)
+        {
+          return traits_type::eof();
+        }
+        setg(_chunk, _chunk, _chunk + _in.gcount());
+      }
+      return traits_type::to_int_type(*gptr());
+    }
+
+  private:
+    Bytestream _prefix;
+    std::istream& _in;
+    char _chunk[64 * 1024];
+  };
+
+  PrefixedBuf _buf;
+};
+
+constexpr size_t WRITE_CHUNK_SIZE = 1024 * 1024;
+
+// Hands the rest of the stream to writeFun a chunk at a time, so it is never all
+// in memory and the first chunk can be on its way while the rest is read
+inline bool write_in_chunks(std::istream& in, const WriteFun& writeFun,
+                            size_t chunkSize = WRITE_CHUNK_SIZE)
+{
+  Array<uint8_t> buffer(chunkSize);
+  uint8_t* data = buffer;
+  while(in.read(reinterpret_cast<char*>(data), chunkSize) || in.gcount() != 0)
+  {
+    if(!writeFun(Bytestream(data, in.gcount())))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Read-only memory map of a regular file, for reading without copying.
+// Evaluates to false for anything that can not be mapped, e.g. pipes.
+class MappedInFile
+{
+public:
+  MappedInFile() = delete;
+  MappedInFile(const MappedInFile&) = delete;
+  MappedInFile& operator=(const MappedInFile&) = delete;
+
+  MappedInFile(const std::string& name)
+  {
+    int fd = open(name.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd < 0)
+    {
+      return;
+    }
+    struct stat st;
+    if(fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+      void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(data != MAP_FAILED)
+      {
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        _data = static_cast<const uint8_t*>(data);
+        _size = st.st_size;
+      }
+    }
+    close(fd);
+  }
+
+  ~MappedInFile()
+  {
+    if(_data != nullptr)
+    {
+      munmap(const_cast<uint8_t*>(_data), _size);
+    }
+  }
+
+  const uint8_t* data() const
+  {
+    return _data;
+  }
+
+  size_t size() const
+  {
+    return _size;
+  }
+
+  explicit operator bool() const
+  {
+    return _data != nullptr;
+  }
+
+private:
+  const uint8_t* _data = nullptr;
+  size_t _size = 0;
+};
+
 class OutBinFile
 {
 public:
@@ -93,4 +232,135 @@ private:
   std::ostream* out;
 };
 
+// Output straight to a file descriptor, bypassing iostreams.
+// Small writes are collected in an aligned buffer, and flushed together with
+// the next large write in a single writev.
+class BufferedOutFile
+{
+public:
+  static constexpr size_t Alignment = 4096;
+  static constexpr size_t DefaultBufferSize = 1024 * 1024;
+
+  BufferedOutFile() = delete;
+  BufferedOutFile(const BufferedOutFile&) = delete;
+  BufferedOutFile& operator=(const BufferedOutFile&) = delete;
+
+  BufferedOutFile(const std::string& name, size_t bufferSize = DefaultBufferSize)
+  : _capacity(((bufferSize + Alignment - 1) / Alignment) * Alignment)
+  {
+    if(name == "-")
+    {
+      _fd = STDOUT_FILENO;
+    }
+    else
+    {
+      _fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+      _owned = true;
+    }
+    _buffer = static_cast<uint8_t*>(std::aligned_alloc(Alignment, _capacity));
+    if(_buffer == nullptr)
+    {
+      _failed = true;
+    }
+  }
+
+  ~BufferedOutFile()
+  {
+    flush();
+    if(_owned && _fd >= 0)
+    {
+      close(_fd);
+    }
+    std::free(_buffer);
+  }
+
+  bool write(const void* data, size_t size)
+  {
+    if(!*this)
+    {
+      return false;
+    }
+    if(size <= _capacity - _used)
+    {
+      memcpy(_buffer + _used, data, size);
+      _used += size;
+      return true;
+    }
+    iovec iov[2] = {{_buffer, _used}, {const_cast<void*>(data), size}};
+    _used = 0;
+    return writeAll(iov, 2);
+  }
+
+  bool write(const Bytestream& bts)
+  {
+    return write(bts.raw(), bts.size());
+  }
+
+  bool write(const std::string& str)
+  {
+    return write(str.data(), str.size());
+  }
+
+  template <typename T>
+  BufferedOutFile& operator<<(const T& t)
+  {
+    write(t);
+    return *this;
+  }
+
+  bool flush()
+  {
+    if(_used == 0 || !*this)
+    {
+      return !_failed;
+    }
+    iovec iov[1] = {{_buffer, _used}};
+    _used = 0;
+    return writeAll(iov, 1);
+  }
+
+  explicit operator bool() const
+  {
+    return _fd >= 0 && !_failed;
+  }
+
+private:
+  bool writeAll(iovec* iov, int count)
+  {
+    while(count != 0)
+    {
+      ssize_t written = writev(_fd, iov, count);
+      if(written < 0)
+      {
+        if(errno == EINTR)
+        {
+          continue;
+        }
+        _failed = true;
+        return false;
+      }
+      size_t remaining = written;
+      while(count != 0 && remaining >= iov->iov_len)
+      {
+        remaining -= iov->iov_len;
+        iov++;
+        count--;
+      }
+      if(count != 0)
+      {
+        iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + remaining;
+        iov->iov_len -= remaining;
+      }
+    }
+    return true;
+  }
+
+  int _fd = -1;
+  bool _owned = false;
+  bool _failed = false;
+  uint8_t* _buffer = nullptr;
+  size_t _capacity = 0;
+  size_t _used = 0;
+};
+
 #endif //BINFILE_H
@@ -0,0 +1,69 @@
+#ifndef BOUNDEDQUEUE_H
+#define BOUNDEDQUEUE_H
+
+#include "list.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <optional>
+
+// Blocking FIFO for handing work between threads, holding at most capacity items.
+// Once closed, pushing fails and popping drains what is left.
+template <typename T>
+class BoundedQueue
+{
+public:
+  BoundedQueue() = delete;
+  BoundedQueue(const BoundedQueue&) = delete;
+  BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+  BoundedQueue(size_t capacity) : _capacity(capacity == 0 ? 1 : capacity)
+  {}
+
+  // Blocks while full, returns false if the queue has been closed
+  bool push(T&& item)
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _notFull.wait(lock, [this](){return _closed || _items.size() < _capacity;});
+    if(_closed)
+    {
+      return false;
+    }
+    _items.push_back(std::move(item));
+    _notEmpty.notify_one();
+    return true;
+  }
+
+  // Blocks while empty, returns nothing once closed and drained
+  std::optional<T> pop()
+  {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _notEmpty.wait(lock, [this](){return _closed || !_items.empty();});
+    if(_items.empty())
+    {
+      return {};
+    }
+    std::optional<T> item(std::move(_items.front()));
+    _items.pop_front();
+    _notFull.notify_one();
+    return item;
+  }
+
+  void close()
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _closed = true;
+    _notFull.notify_all();
+    _notEmpty.notify_all();
+  }
+
+private:
+  size_t _capacity;
+  bool _closed = false;
+  List<T> _items;
+  std::mutex _mutex;
+  std::condition_variable _notFull;
+  std::condition_variable _notEmpty;
+};
+
+#endif // BOUNDEDQUEUE_H
@@ -0,0 +1,116 @@
+#ifndef COMPRESSIONTUNER_H
+#define COMPRESSIONTUNER_H
+
+#include "bytestream.h"
+#include "minimime.h"
+#include "paralleldeflate.h"
+
+#include <zlib.h>
+#include <string>
+
+struct CompressionChoice
+{
+  bool enabled = false;
+  int level = Z_DEFAULT_COMPRESSION;
+  int strategy = Z_DEFAULT_STRATEGY;
+  // Compressed over uncompressed size of the trial, 1 if none was made
+  double ratio = 1.0;
+  std::string reason;
+};
+
+// Picks deflate level and strategy by document format, then trial-compresses
+// the start of the document and turns compression off if it saves too little.
+class CompressionTuner
+{
+public:
+  static constexpr size_t TrialSize = 256 * 1024;
+  // Needs to save at least 10% to be worth the CPU time, for us and the printer
+  static constexpr double MaxRatio = 0.9;
+
+  CompressionTuner() = delete;
+  CompressionTuner(const CompressionTuner&) = delete;
+  CompressionTuner& operator=(const CompressionTuner&) = delete;
+
+  CompressionTuner(const std::string& format)
+  {
+    _choice.enabled = true;
+    if(format == MiniMime::JPEG || format == MiniMime::PNG
+       || format == MiniMime::GIF || format == MiniMime::TIFF)
+    {
+      _choice.enabled = false;
+      _choice.reason = format + " is already compressed";
+    }
+    else if(MiniMime::isPrinterRaster(format))
+    {
+      // The raster is run-length encoded already, but whole runs of lines
+      // repeat. Only looking for runs is about 1.5x as fast and almost as good.
+      _choice.strategy = Z_RLE;
+    }
+  }
+
+  // Collects the start of the document, true once there is enough to decide
+  bool addSample(const Bytestream& data)
+  {
+    if(_choice.enabled && _sample.size() < TrialSize)
+    {
+      _sample.putBytes(data.raw(), std::min(data.size(), TrialSize - _sample.size()));
+    }
+    return !_choice.enabled || _sample.size() >= TrialSize;
+  }
+
+  CompressionChoice choose()
+  {
+    if(!_choice.enabled)
+    {
+      return _choice;
+    }
+    if(_sample.size() == 0)
+    {
+      _choice.enabled = false;
+      _choice.reason = "nothing to compress";
+      return _choice;
+    }
+
+    z_stream strm {};
+    deflateInit2(&strm, _choice.level, Z_DEFLATED, -ParallelDeflate::WindowBits,
+                 ParallelDeflate::MemLevel, _choice.strategy);
+    Bytestream out(size_t(deflateBound(&strm, _sample.size())));
+    strm.next_in = _sample.raw();
+    strm.avail_in = _sample.size();
+    strm.next_out = out.raw();
+    strm.avail_out = out.size();
+    deflate(&strm, Z_FINISH);
+    _choice.ratio = double(strm.total_out) / _sample.size();
+    deflateEnd(&strm);
+
+    if(_choice.ratio > MaxRatio)
+    {
+      _choice.enabled = false;
+      _choice.reason = "saves too little";
+    }
+    return _choice;
+  }
+
+  static const char* strategyName(int strategy)
+  {
+    switch(strategy)
+    {
+      case Z_FILTERED:
+        return "filtered";
+      case Z_HUFFMAN_ONLY:
+        return "Huffman-only";
+      case Z_RLE:
+        return "run-length";
+      case Z_FIXED:
+        return "fixed";
+      default:
+        return "default";
+    }
+  }
+
+private:
+  CompressionChoice _choice;
+  Bytestream _sample;
+};
+
+#endif // COMPRESSIONTUNER_H
@@ -1,13 +1,18 @@
 #ifndef CONVERTER_H
 #define CONVERTER_H
 
+#include "array.h"
 #include "baselinify.h"
 #include "binfile.h"
+#include "crlfnormalizer.h"
 #include "error.h"
 #include "functions.h"
 #include "ippprintjob.h"
+#include "jpeg2raster.h"
+#include "log.h"
 #include "minimime.h"
 #include "pdf2printable.h"
+#include "resample.h"
 #include "stringutils.h"
 
 #include <functional>
@@ -42,7 +47,7 @@ public:
     };
 
   ConvertFun Baselinify =
-    [](const std::string& inFileName, const IppPrintJob&,
+    [](const std::string& inFileName, const IppPrintJob& job,
        const WriteFun& writeFun, const ProgressFun& progressFun)
     {
       InBinFile in(inFileName);
@@ -50,15 +55,59 @@ public:
       {
         return Error("Failed to open input");
       }
-      Bytestream inBts(in);
-      Bytestream baselinified;
-      baselinify(inBts, baselinified);
-      writeFun(std::move(baselinified));
+      bool strip = job.printParams.stripJpegMarkers;
+      // Looked at once and then passed on again, as stdin can not seek back
+      Bytestream head = read_jpeg_head(in);
+      bool sequential = is_sequential_jpeg(head);
+      unsigned int eighths = 8;
+      if(job.printParams.downscaleJpeg)
+      {
+        eighths = jpeg_downscale_eighths(head, job.printParams.getPaperSizeWInPixels(),
+                                         job.printParams.getPaperSizeHInPixels());
+      }
+      PrefixedInStream jpeg(std::move(head), in);
+      if(eighths < 8)
+      {
+        DBG(<< "Downscaling JPEG to " << eighths << "/8 for the print resolution");
+        Error error = downscale_jpeg(jpeg, writeFun, eighths, strip);
+        if(error)
+        {
+          return error;
+        }
+      }
+      else if(sequential)
+      {
+        // Already what printers want, no need to transcode
+        DBG(<< "JPEG is already sequential, sending it as is");
+        if(strip)
+        {
+          strip_jpeg_markers(jpeg, writeFun);
+        }
+        else
+        {
+          write_in_chunks(jpeg, writeFun);
+        }
+      }
+      else
+      {
+        Error error = baselinify(jpeg, writeFun, strip);
+        if(error)
+        {
+          return error;
+        }
+      }
       progressFun(1, 1);
-      // We'll check on the cURL status in just a bit, so no point in returning errors here.
+      // Failed writes in the other cases show up in the cURL status in just a bit.
       return Error();
     };
 
+  ConvertFun JpegToRaster =
+    [](const std::string& inFileName, const IppPrintJob& job,
+       const WriteFun& writeFun, const ProgressFun& progressFun)
+    {
+      return jpeg_to_raster(inFileName, job.printParams, writeFun, progressFun);
+    };
+
   ConvertFun JustUpload =
     [](const std::string& inFileName, const IppPrintJob&,
        const WriteFun& writeFun, const ProgressFun& progressFun)
@@ -68,8 +117,54 @@ public:
       {
         return Error("Failed to open input");
       }
-      Bytestream inBts(in);
-      writeFun(std::move(inBts));
+      write_in_chunks(in, writeFun);
+      progressFun(1, 1);
+      return Error();
+    };
+
+  ConvertFun ResampleRaster =
+    [](const std::string& inFileName, const IppPrintJob& job,
+       const WriteFun& writeFun, const ProgressFun& progressFun)
+    {
+      InBinFile in(inFileName);
+      if(!in)
+      {
+        return Error("Failed to open input");
+      }
+      // The first page header is enough to tell if resampling is needed
+      char head[2048];
+      in->read(head, sizeof(head));
+      Bytestream headBts(head, in->gcount());
+      // Carries on after what was already read, as the input may not seek (stdin)
+      PrefixedInStream raster(headBts, in);
+
+      uint32_t resX = 0;
+      uint32_t resY = 0;
+      // Raster is not converted, so the print parameters don't have the format
+      List<IppResolution> supported = job.supportedRasterResolutions(job.targetFormat);
+      if(raster_resolution(headBts, resX, resY) && !supported.empty()
+         && !supported.contains(IppResolution {resX, resY, IppResolution::DPI}))
+      { // Pick the highest supported resolution we can reach by whole factors
+        std::optional<IppResolution> target;
+        for(const IppResolution& res : supported)
+        {
+          size_t factor;
+          if(downsample_factor(resX, res.x, factor) && downsample_factor(resY, res.y, factor)
+             && (!target || (res.x * res.y) > (target->x * target->y)))
+          {
+            target = res;
+          }
+        }
+        if(target)
+        {
+          DBG(<< "Downsampling raster from " << resX << "x" << resY << " to " << target->toStr());
+          return resample_raster(raster, target->x, target->y, LineResampler::BoxFilter,
+                                 writeFun, progressFun);
+        }
+        WARN(<< "Raster resolution " << resX << "x" << resY << " is not supported by the printer");
+      }
+
+      write_in_chunks(raster, writeFun);
       progressFun(1, 1);
       return Error();
     };
@@ -83,17 +178,19 @@ public:
     {
       return Error("Failed to open input");
     }
-    Bytestream inBts(in);
-    std::string allText = inBts.getString(inBts.size());
 
-    List<std::string> lines;
-    for(const std::string& rnline : split_string(allText, "\r\n"))
+    const size_t chunkSize = 64 * 1024;
+    Array<uint8_t> buffer(chunkSize);
+    uint8_t* data = buffer;
+    CrlfNormalizer normalizer(writeFun);
+    while(in->read(reinterpret_cast<char*>(data), chunkSize) || in->gcount() != 0)
     {
-      lines += split_string(rnline, "\n");
+      if(!normalizer.write(data, in->gcount()))
+      {
+        break;
+      }
     }
-    std::string outString = join_string(lines, "\r\n");
 
-    writeFun(outString);
     progressFun(1, 1);
     return Error();
   };
@@ -104,6 +201,8 @@ public:
      {{MiniMime::PDF, MiniMime::PWG}, Pdf2Printable},
      {{MiniMime::PDF, MiniMime::URF}, Pdf2Printable},
      {{MiniMime::JPEG, MiniMime::JPEG}, Baselinify},
+     {{MiniMime::JPEG, MiniMime::PWG}, JpegToRaster},
+     {{MiniMime::JPEG, MiniMime::URF}, JpegToRaster},
      {{"text/plain", "text/plain"}, FixupText}};
 
   std::optional<ConvertFun> getConvertFun(const std::string& inputFormat,
@@ -118,7 +217,7 @@ public:
     }
     if(inputFormat == targetFormat)
     {
-      return JustUpload;
+      return MiniMime::isPrinterRaster(inputFormat) ? ResampleRaster : JustUpload;
     }
     return {};
   }
@@ -0,0 +1,53 @@
+#ifndef CRLFNORMALIZER_H
+#define CRLFNORMALIZER_H
+
+#include "bytestream.h"
+#include "functions.h"
+
+#include <cstring>
+
+// Turns lone LFs into CRLFs and leaves existing CRLFs alone, one chunk at a time.
+// A CR ending one chunk is remembered, so pairs split between chunks stay intact.
+class CrlfNormalizer
+{
+public:
+  CrlfNormalizer() = delete;
+  CrlfNormalizer(const CrlfNormalizer&) = delete;
+  CrlfNormalizer& operator=(const CrlfNormalizer&) = delete;
+
+  CrlfNormalizer(const WriteFun& writeFun) : _writeFun(writeFun)
+  {}
+
+  bool write(const uint8_t* data, size_t size)
+  {
+    if(size == 0)
+    {
+      return true;
+    }
+    Bytestream out;
+    size_t start = 0;
+    // memchr is vectorized in any libc worth using, so the LF search is the cheap part
+    for(const uint8_t* lf = static_cast<const uint8_t*>(memchr(data, '\n', size));
+        lf != nullptr;
+        lf = static_cast<const uint8_t*>(memchr(lf + 1, '\n', size - (lf + 1 - data))))
+    {
+      size_t pos = lf - data;
+      bool afterCr = pos == 0 ? _endedWithCr : data[pos - 1] == '\r';
+      if(!afterCr)
+      {
+        out.putBytes(data + start, pos - start);
+        out.putBytes("\r\n", 2);
+        start = pos + 1;
+      }
+    }
+    out.putBytes(data + start, size - start);
+    _endedWithCr = data[size - 1] == '\r';
+    return _writeFun(std::move(out));
+  }
+
+private:
+  const WriteFun& _writeFun;
+  bool _endedWithCr = false;
+};
+
+#endif // CRLFNORMALIZER_H
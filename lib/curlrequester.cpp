@@ -2,37 +2,78 @@
 
 #include "log.h"
 
-#include <chrono>
 #include <cstring>
-#include <thread>
 
-CurlRequester::CurlRequester(const Url& addr, const SslConfig& sslConfig)
-  : _curl(curl_easy_init())
+CurlSession::CurlSession()
+  : _share(curl_share_init())
 {
+  curl_share_setopt(_share, CURLSHOPT_LOCKFUNC, lock);
+  curl_share_setopt(_share, CURLSHOPT_UNLOCKFUNC, unlock);
+  curl_share_setopt(_share, CURLSHOPT_USERDATA, this);
+  curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+  curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  curl_share_setopt(_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+}
+
+CurlSession::~CurlSession()
+{
+  curl_share_cleanup(_share);
+}
+
+// Requests run on their own threads, so the shared data needs locking
+void CurlSession::lock(CURL*, curl_lock_data data, curl_lock_access, void* userptr)
+{
+  static_cast<CurlSession*>(userptr)->_locks[data].lock();
+}
+
+void CurlSession::unlock(CURL*, curl_lock_data data, void* userptr)
+{
+  static_cast<CurlSession*>(userptr)->_locks[data].unlock();
+}
+
+CurlRequester::CurlRequester(const Url& addr, const SslConfig& sslConfig,
+                             std::shared_ptr<CurlSession> session)
+  : _session(std::move(session)), _curl(curl_easy_init())
+{
+  _opts = configure(_curl, addr, sslConfig);
+
+  if(_session)
+  {
+    curl_easy_setopt(_curl, CURLOPT_SHARE, _session->_share);
+  }
+}
+
+curl_slist* CurlRequester::configure(CURL* curl, const Url& addr, const SslConfig& sslConfig)
+{
+  curl_slist* opts = nullptr;
   bool debugEnabled = LogController::instance().isEnabled(LogController::Debug);
-  curl_easy_setopt(_curl, CURLOPT_URL, addr.toStr().c_str());
-  curl_easy_setopt(_curl, CURLOPT_VERBOSE, debugEnabled);
-  curl_easy_setopt(_curl, CURLOPT_CONNECTTIMEOUT_MS, 2000);
-  curl_easy_setopt(_curl, CURLOPT_FAILONERROR, 1);
+  if(addr.isUnixSocket())
+  {
+    curl_easy_setopt(curl, CURLOPT_UNIX_SOCKET_PATH, addr.getSocketPath().c_str());
+  }
+  curl_easy_setopt(curl, CURLOPT_URL, addr.localUrl().toStr().c_str());
+  curl_easy_setopt(curl, CURLOPT_VERBOSE, debugEnabled);
+  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, 2000);
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1);
 
   if(!sslConfig._verifySsl)
   {
-    curl_easy_setopt(_curl, CURLOPT_SSL_VERIFYPEER, 0L);
-    curl_easy_setopt(_curl, CURLOPT_SSL_VERIFYHOST, 0L);
-    curl_easy_setopt(_curl, CURLOPT_SSL_VERIFYSTATUS, 0L);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 0L);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 0L);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYSTATUS, 0L);
   }
 
   if(sslConfig._pinnedPublicKey != "")
   {
-    curl_easy_setopt(_curl, CURLOPT_PINNEDPUBLICKEY, sslConfig._pinnedPublicKey.c_str());
+    curl_easy_setopt(curl, CURLOPT_PINNEDPUBLICKEY, sslConfig._pinnedPublicKey.c_str());
   }
 
   if(!_userAgent.empty())
   {
     std::string userAgentOpt = "User-Agent: " + _userAgent;
-    _opts = curl_slist_append(_opts, userAgentOpt.c_str());
+    opts = curl_slist_append(opts, userAgentOpt.c_str());
   }
-
+  return opts;
 }
 
 CurlRequester::~CurlRequester()
@@ -54,6 +95,10 @@ void CurlRequester::doRun()
 
     _result = curl_easy_perform(_curl);
     _resultMsg = buf;
+    if(_onFinished)
+    {
+      _onFinished();
+    }
   });
 }
 
@@ -82,107 +127,148 @@ CurlIppPosterBase::~CurlIppPosterBase()
 
 bool CurlIppPosterBase::write(Bytestream&& data)
 {
-  while(!_canWrite.try_lock())
+  if(data.size() == 0)
+  {
+    return true;
+  }
+  Chunk chunk;
+  chunk.bufferedBytes = data.size();
   {
-    if(!_worker.isRunning())
+    std::unique_lock<std::mutex> lock(_mutex);
+    std::chrono::steady_clock::time_point waitStart = std::chrono::steady_clock::now();
+    // Let a chunk larger than the whole budget through when the queue is empty
+    _canWrite.wait(lock, [this, &data]()
+                   {
+                     return _finished || _bufferedBytes == 0
+                         || _bufferedBytes + data.size() <= _bufferBudget;
+                   });
+    _stats.writeBlocked += std::chrono::steady_clock::now() - waitStart;
+    if(_finished)
     {
       return false;
     }
-    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    _bufferedBytes += data.size();
+    _stats.bytesIn += data.size();
   }
 
-  _data = std::move(data);
-  _compression = _nextCompression;
-  _canRead.unlock();
-  return true;
-}
-
-size_t CurlIppPosterBase::requestWrite(char* dest, size_t size)
-{
-  if(!_reading)
+  // Outside the lock, so the reader can go on while the compressors are busy
+  if(_deflate)
   {
-    _canRead.lock();
-    _reading = true;
+    chunk.blocks = _deflate->compress(std::move(data));
   }
-
-  size_t remaining = _data.remaining();
-  size_t bytesWritten = 0;
-
-  if(_compression != NoCompression)
+  else
   {
-    _zstrm.next_out = reinterpret_cast<Bytef*>(dest);
-    _zstrm.avail_out = size;
-    _zstrm.next_in = (_data.raw() + _data.pos());
-    _zstrm.avail_in = remaining;
-    deflate(&_zstrm, _done ? Z_FINISH : Z_NO_FLUSH);
-    bytesWritten = size - _zstrm.avail_out;
-    _data += (remaining - _zstrm.avail_in);
-  }
-  else // No compression = memcpy
-  {
-    bytesWritten = std::min(size, remaining);
-    if(bytesWritten != 0) // Please the ubsan
-    {
-      _data.getBytes(dest, bytesWritten);
-    }
+    chunk.data = std::move(data);
   }
 
-  if(!_done)
+  std::lock_guard<std::mutex> lock(_mutex);
+  _queue.push_back(std::move(chunk));
+  _canRead.notify_one();
+  return !_finished;
+}
+
+size_t CurlIppPosterBase::requestWrite(char* dest, size_t size)
+{
+  while(_current.data.atEnd())
   {
-    if(_data.atEnd())
-    { // End of input
-      _reading = false;
-      _canWrite.unlock();
+    if(!_current.blocks.empty())
+    { // Blocks are joined in order, waiting for each to be compressed
+      try
+      {
+        std::chrono::steady_clock::time_point waitStart = std::chrono::steady_clock::now();
+        ParallelDeflate::Block block = _current.blocks.front().get();
+        _stats.waitedForCompression += std::chrono::steady_clock::now() - waitStart;
+        _current.data = _deflate->join(std::move(block));
+      }
+      catch(...)
+      {
+        return CURL_READFUNC_ABORT;
+      }
+      _current.blocks.pop_front();
+      continue;
     }
-    if(bytesWritten == 0)
-    { // Compression produced no output this time,
-      // we'll most likely have gone to write mode,
-      // keep waiting.
-      return requestWrite(dest, size);
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _bufferedBytes -= _current.bufferedBytes;
+    _current = Chunk();
+    _canWrite.notify_all();
+
+    std::chrono::steady_clock::time_point waitStart = std::chrono::steady_clock::now();
+    _canRead.wait(lock, [this](){return _done || !_queue.empty();});
+    _stats.waitedForData += std::chrono::steady_clock::now() - waitStart;
+    if(_queue.empty())
+    { // End of input, close the compressed stream
+      if(!_deflate || _deflateFinished)
+      {
+        return 0;
+      }
+      _current.data = _deflate->finish();
+      _deflateFinished = true;
+      continue;
     }
+    _current = std::move(_queue.front());
+    _queue.pop_front();
   }
 
+  size_t bytesWritten = std::min(size, _current.data.remaining());
+  _current.data.getBytes(dest, bytesWritten);
+  _stats.bytesOut += bytesWritten;
   return bytesWritten;
 }
 
-void CurlIppPosterBase::setCompression(Compression compression)
+void CurlIppPosterBase::finished()
 {
-  if(_nextCompression != NoCompression)
-  {
-    throw std::logic_error("unsetting/changing compression");
-  }
-  _nextCompression = compression;
+  std::lock_guard<std::mutex> lock(_mutex);
+  _stats.elapsed = std::chrono::steady_clock::now() - _start;
+  _finished = true;
+  _canWrite.notify_all();
+}
 
-  _zstrm.zalloc = Z_NULL;
-  _zstrm.zfree = Z_NULL;
-  _zstrm.opaque = Z_NULL;
+CurlIppPosterBase::UploadStats CurlIppPosterBase::stats()
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _stats;
+}
 
-  int level = 11;
-  if(compression == Compression::Deflate)
+void CurlIppPosterBase::setBufferBudget(size_t bytes)
+{
+  std::lock_guard<std::mutex> lock(_mutex);
+  _bufferBudget = bytes;
+  _canWrite.notify_all();
+}
+
+void CurlIppPosterBase::setCompression(Compression compression, int level, int strategy,
+                                       size_t threads)
+{
+  if(_deflate)
   {
-    level *= -1;
+    throw std::logic_error("unsetting/changing compression");
   }
-  else if(compression == Compression::Gzip)
+  if(compression == NoCompression)
   {
-    level += 16;
+    return;
   }
-
-  deflateInit2(&_zstrm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, level, 7, Z_DEFAULT_STRATEGY);
+  ParallelDeflate::Format format = compression == Gzip ? ParallelDeflate::Gzip
+                                                       : ParallelDeflate::Raw;
+  std::lock_guard<std::mutex> lock(_mutex);
+  _deflate = std::make_unique<ParallelDeflate>(format, threads, level, strategy);
 }
 
 std::string http_url(Url& url)
 {
-  if(url.getScheme() == "ipp")
+  std::string socket = url.isUnixSocket() ? "+unix" : "";
+  std::string scheme = url.localUrl().getScheme();
+  if(scheme == "ipp")
   {
-    url.setScheme("http");
+    url.setScheme("http" + socket);
     if(!url.getPort())
     {
       url.setPort(631);
     }
   }
-  else if(url.getScheme() == "ipps")
+  else if(scheme == "ipps")
   {
-    url.setScheme("https");
+    url.setScheme("https" + socket);
     if(!url.getPort())
     {
       url.setPort(443);
@@ -191,12 +277,11 @@ std::string http_url(Url& url)
   return url.toStr();
 }
 
-CurlIppPosterBase::CurlIppPosterBase(Url addr, const SslConfig& sslConfig)
-  : CurlRequester(http_url(addr), sslConfig)
+CurlIppPosterBase::CurlIppPosterBase(Url addr, const SslConfig& sslConfig,
+                                     std::shared_ptr<CurlSession> session)
+  : CurlRequester(http_url(addr), sslConfig, std::move(session)),
+    _start(std::chrono::steady_clock::now())
 {
-  _canWrite.unlock();
-  _canRead.lock();
-
   curl_easy_setopt(_curl, CURLOPT_POST, 1L);
   curl_easy_setopt(_curl, CURLOPT_UPLOAD_BUFFERSIZE, 2*1024*1024);
   curl_easy_setopt(_curl, CURLOPT_READFUNCTION, trampoline);
@@ -205,38 +290,49 @@ CurlIppPosterBase::CurlIppPosterBase(Url addr, const SslConfig& sslConfig)
   _opts = curl_slist_append(_opts, "Expect:");
   _opts = curl_slist_append(_opts, "Content-Type: application/ipp");
   _opts = curl_slist_append(_opts, "Accept-Encoding: identity");
+
+  _onFinished = [this]()
+  {
+    finished();
+  };
 }
 
 CURLcode CurlIppPosterBase::await(Bytestream* data)
 {
-  while(_worker.isRunning() && !_canWrite.try_lock())
   {
-    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    std::lock_guard<std::mutex> lock(_mutex);
+    if(!_done && _deflate)
+    { // Data held back for a full block
+      Chunk chunk;
+      chunk.blocks = _deflate->flush();
+      _queue.push_back(std::move(chunk));
+    }
+    _done = true;
+    _canRead.notify_all();
   }
-
-  _done = true;
-  _data = Bytestream();
-  _canRead.unlock();
   return CurlRequester::await(data);
 }
 
-CurlIppPoster::CurlIppPoster(const Url& addr, Bytestream&& data, const SslConfig& sslConfig)
-  : CurlIppPosterBase(addr, sslConfig)
+CurlIppPoster::CurlIppPoster(const Url& addr, Bytestream&& data, const SslConfig& sslConfig,
+                             std::shared_ptr<CurlSession> session)
+  : CurlIppPosterBase(addr, sslConfig, std::move(session))
 {
   curl_easy_setopt(_curl, CURLOPT_POSTFIELDSIZE, data.size());
   write(std::move(data));
   doRun();
 }
 
-CurlIppStreamer::CurlIppStreamer(const Url& addr, const SslConfig& sslConfig)
-  : CurlIppPosterBase(addr, sslConfig)
+CurlIppStreamer::CurlIppStreamer(const Url& addr, const SslConfig& sslConfig,
+                                 std::shared_ptr<CurlSession> session)
+  : CurlIppPosterBase(addr, sslConfig, std::move(session))
 {
   _opts = curl_slist_append(_opts, "Transfer-Encoding: chunked");
   doRun();
 }
 
-CurlHttpGetter::CurlHttpGetter(const Url& addr, const SslConfig& sslConfig)
-  : CurlRequester(addr, sslConfig)
+CurlHttpGetter::CurlHttpGetter(const Url& addr, const SslConfig& sslConfig,
+                               std::shared_ptr<CurlSession> session)
+  : CurlRequester(addr, sslConfig, std::move(session))
 {
   doRun();
 }
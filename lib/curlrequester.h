@@ -2,11 +2,16 @@
 #define CURLREQUESTER_H
 
 #include "bytestream.h"
+#include "list.h"
 #include "lthread.h"
+#include "paralleldeflate.h"
 #include "url.h"
 
 #include <curl/curl.h>
-#include <zlib.h>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
 #include <mutex>
 
 class SslConfig
@@ -21,6 +26,25 @@ private:
   std::string _pinnedPublicKey;
 };
 
+// Shares connections, TLS sessions and DNS lookups between the requests made with it,
+// so consecutive requests to the same printer can reuse one keep-alive connection
+class CurlSession
+{
+friend class CurlRequester;
+public:
+  CurlSession();
+  ~CurlSession();
+  CurlSession(const CurlSession&) = delete;
+  CurlSession& operator=(const CurlSession&) = delete;
+
+private:
+  static void lock(CURL*, curl_lock_data data, curl_lock_access, void* userptr);
+  static void unlock(CURL*, curl_lock_data data, void* userptr);
+
+  CURLSH* _share;
+  std::mutex _locks[CURL_LOCK_DATA_LAST];
+};
+
 class CurlRequester
 {
 public:
@@ -33,12 +57,20 @@ public:
 
   static void setUserAgent(std::string userAgent);
 
+  // Sets the options common to all requests, returning the headers to go with them
+  static curl_slist* configure(CURL* curl, const Url& addr, const SslConfig& sslConfig);
+
 protected:
 
-  CurlRequester(const Url& addr, const SslConfig& sslConfig);
+  CurlRequester(const Url& addr, const SslConfig& sslConfig,
+                std::shared_ptr<CurlSession> session = nullptr);
 
   void doRun();
 
+  // Called on the worker thread when the transfer is over, successful or not.
+  // Not a virtual, as the call could race with the destructors changing the vtable.
+  std::function<void()> _onFinished;
+
   CurlRequester();
 
   static size_t write_callback(char *ptr, size_t size, size_t nmemb, void* userdata)
@@ -69,6 +101,8 @@ protected:
 
   Bytestream _data;
 
+  // Kept alive for as long as the handle using it
+  std::shared_ptr<CurlSession> _session;
   CURL* _curl;
   struct curl_slist* _opts = nullptr;
 
@@ -88,13 +122,51 @@ public:
     Gzip
   };
 
+  static constexpr size_t DefaultBufferBudget = 16 * 1024 * 1024;
+
+  // Where the time went, to tell converter, compression and network bound uploads apart
+  struct UploadStats
+  {
+    // As written, and as sent after compression
+    size_t bytesIn = 0;
+    size_t bytesOut = 0;
+    // write() waiting for buffer room, i.e. the network or compressors are slower
+    std::chrono::duration<double> writeBlocked {};
+    // cURL waiting for written data, i.e. the converter is slower
+    std::chrono::duration<double> waitedForData {};
+    // cURL waiting for blocks still being compressed
+    std::chrono::duration<double> waitedForCompression {};
+    // From the start of the request until it is over
+    std::chrono::duration<double> elapsed {};
+
+    double ratio() const
+    {
+      return bytesIn != 0 ? double(bytesOut) / bytesIn : 1.0;
+    }
+    // Bytes sent per second
+    double rate() const
+    {
+      return elapsed.count() != 0 ? bytesOut / elapsed.count() : 0.0;
+    }
+  };
+
   ~CurlIppPosterBase();
   CURLcode await(Bytestream* = nullptr) override;
 
+  // Queues data for upload, blocking while the buffer budget is used up.
+  // Returns false if the transfer has ended.
   bool write(Bytestream&& data);
   size_t requestWrite(char* dest, size_t size);
 
-  void setCompression(Compression compression);
+  // Data written from here on is compressed on a pool of threads, zero meaning one per core
+  void setCompression(Compression compression, int level = Z_DEFAULT_COMPRESSION,
+                      int strategy = Z_DEFAULT_STRATEGY, size_t threads = 0);
+
+  // How much written data may wait for upload, a single larger write is still let through
+  void setBufferBudget(size_t bytes);
+
+  // Complete once await() has returned
+  UploadStats stats();
 
   static size_t trampoline(char* dest, size_t size, size_t nmemb, void* userp)
   {
@@ -102,35 +174,62 @@ public:
   }
 
 protected:
-  CurlIppPosterBase(Url addr, const SslConfig& sslConfig=SslConfig());
+  CurlIppPosterBase(Url addr, const SslConfig& sslConfig=SslConfig(),
+                    std::shared_ptr<CurlSession> session=nullptr);
+
+  // Hooked up as _onFinished
+  void finished();
 
 private:
-  std::mutex _canWrite;
-  std::mutex _canRead;
-  bool _reading = false;
+  struct Chunk
+  {
+    Bytestream data;
+    List<std::future<ParallelDeflate::Block>> blocks;
+    size_t bufferedBytes = 0;
+  };
+
+  std::mutex _mutex;
+  std::condition_variable _canWrite;
+  std::condition_variable _canRead;
+  List<Chunk> _queue;
+  size_t _bufferedBytes = 0;
+  size_t _bufferBudget = DefaultBufferBudget;
   bool _done = false;
+  bool _finished = false;
 
-  z_stream _zstrm;
-  Compression _nextCompression = NoCompression;
-  Compression _compression = NoCompression;
+  // Only touched by the reading (cURL) thread
+  Chunk _current;
+
+  std::chrono::steady_clock::time_point _start;
+  UploadStats _stats;
+
+  std::unique_ptr<ParallelDeflate> _deflate;
+  bool _deflateFinished = false;
 };
 
 class CurlIppPoster : public CurlIppPosterBase
 {
 public:
-  CurlIppPoster(const Url& addr, Bytestream&& data, const SslConfig& sslConfig=SslConfig());
+  CurlIppPoster(const Url& addr, Bytestream&& data, const SslConfig& sslConfig=SslConfig(),
+                std::shared_ptr<CurlSession> session=nullptr);
 };
 
 class CurlIppStreamer : public CurlIppPosterBase
 {
 public:
-  CurlIppStreamer(const Url& addr, const SslConfig& sslConfig=SslConfig());
+  CurlIppStreamer(const Url& addr, const SslConfig& sslConfig=SslConfig(),
+                  std::shared_ptr<CurlSession> session=nullptr);
 };
 
+// ipp:// and ipps:// as http:// and https://, with the IPP default ports.
+// The +unix variants stay on their socket.
+std::string http_url(Url& url);
+
 class CurlHttpGetter : public CurlRequester
 {
 public:
-  CurlHttpGetter(const Url& addr, const SslConfig& sslConfig=SslConfig());
+  CurlHttpGetter(const Url& addr, const SslConfig& sslConfig=SslConfig(),
+                 std::shared_ptr<CurlSession> session=nullptr);
 };
 
 #endif // CURLREQUESTER_H
@@ -0,0 +1,91 @@
+#ifndef HOLDINGWRITER_H
+#define HOLDINGWRITER_H
+
+#include "bytestream.h"
+#include "functions.h"
+#include "list.h"
+#include "log.h"
+
+#include <functional>
+
+// Holds written data back until what it goes after is ready, e.g. the request
+// for a document that is still being created. Starts once that is ready,
+// or when holding more would take too much memory, and then writes straight on.
+class HoldingWriter
+{
+public:
+  HoldingWriter() = delete;
+  HoldingWriter(const HoldingWriter&) = delete;
+  HoldingWriter& operator=(const HoldingWriter&) = delete;
+
+  // begin returns false if there is nothing to write to after all,
+  // the held data is then discarded
+  HoldingWriter(std::function<bool()> ready, std::function<bool()> begin,
+                WriteFun writeFun, size_t maxHeldBytes)
+  : _ready(std::move(ready)), _begin(std::move(begin)), _writeFun(std::move(writeFun)),
+    _maxHeldBytes(maxHeldBytes)
+  {}
+
+  // Holds on to all data while canStart is false, like when more is needed
+  // to decide how to write it. Past the limit, this waits for begin.
+  bool write(Bytestream&& data, bool canStart = true)
+  {
+    if(data.size() == 0)
+    {
+      return true;
+    }
+    if(!_started)
+    {
+      _heldBytes += data.size();
+      _held.push_back(std::move(data));
+      return !canStart || (_heldBytes < _maxHeldBytes && !_ready()) || start();
+    }
+    return _begun && _writeFun(std::move(data));
+  }
+
+  // Begins and writes out what is held, unless already started
+  bool start()
+  {
+    if(_started)
+    {
+      return _begun;
+    }
+    _started = true;
+    _begun = _begin();
+    bool ok = _begun;
+    if(!_begun)
+    {
+      DBG(<< "Discarding " << _heldBytes << " bytes held back");
+    }
+    for(List<Bytestream>::iterator it = _held.begin(); ok && it != _held.end(); it++)
+    {
+      ok = _writeFun(std::move(*it));
+    }
+    _held.clear();
+    _heldBytes = 0;
+    return ok;
+  }
+
+  bool started() const
+  {
+    return _started;
+  }
+
+  size_t heldBytes() const
+  {
+    return _heldBytes;
+  }
+
+private:
+  std::function<bool()> _ready;
+  std::function<bool()> _begin;
+  WriteFun _writeFun;
+  size_t _maxHeldBytes;
+
+  List<Bytestream> _held;
+  size_t _heldBytes = 0;
+  bool _started = false;
+  bool _begun = false;
+};
+
+#endif // HOLDINGWRITER_H
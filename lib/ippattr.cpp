@@ -1,5 +1,6 @@
 #include "ippattr.h"
 
+#include <cstdio>
 #include <iomanip>
 #include <limits>
 
@@ -88,10 +89,22 @@ std::string IppDateTime::toStr() const
   return ss.str();
 }
 
-IppDateTime IppDateTime::fromJSON(const Json::object&)
+// Parses what toJSON() gives, which is the toStr() format
+IppDateTime IppDateTime::fromJSON(const Json& json)
 {
-  // TODO
-  return IppDateTime();
+  unsigned int y, mo, d, h, mi, s, ms, uh, um;
+  char pm = 0;
+  if(!json.is_string()
+     || sscanf(json.string_value().c_str(), "%4u-%2u-%2uT%2u:%2u:%2u.%3u GMT%c%2u%2u",
+               &y, &mo, &d, &h, &mi, &s, &ms, &pm, &uh, &um) != 10
+     || (pm != '+' && pm != '-'))
+  {
+    throw std::invalid_argument("Bad dateTime");
+  }
+  return IppDateTime {static_cast<uint16_t>(y), static_cast<uint8_t>(mo), static_cast<uint8_t>(d),
+                      static_cast<uint8_t>(h), static_cast<uint8_t>(mi), static_cast<uint8_t>(s),
+                      static_cast<uint8_t>(ms / 100), static_cast<uint8_t>(pm),
+                      static_cast<uint8_t>(uh), static_cast<uint8_t>(um)};
 }
 
 Json IppDateTime::toJSON() const
@@ -178,7 +191,11 @@ Json IppAttr::toJSON() const
 
 IppValue IppAttr::valuefromJSON(IppTag tag, const Json& json)
 {
-  if(json.is_string())
+  if(tag == IppTag::DateTime && !json.is_array())
+  {
+    return IppValue(IppDateTime::fromJSON(json));
+  }
+  else if(json.is_string())
   {
     return IppValue(json.string_value());
   }
@@ -207,10 +224,6 @@ IppValue IppAttr::valuefromJSON(IppTag tag, const Json& json)
   {
     return IppValue(IppResolution::fromJSON(json.object_items()));
   }
-  else if(json.is_object() && tag == IppTag::DateTime)
-  {
-    return IppValue(IppDateTime::fromJSON(json.object_items()));
-  }
   else if(json.is_object() && tag == IppTag::BeginCollection)
   {
     IppCollection collection;
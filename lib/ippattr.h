@@ -90,7 +90,7 @@ struct IppDateTime
 
   bool operator==(const IppDateTime& other) const;
   std::string toStr() const;
-  static IppDateTime fromJSON(const Json::object& json);
+  static IppDateTime fromJSON(const Json& json);
   Json toJSON() const;
 };
 
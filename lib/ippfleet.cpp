@@ -0,0 +1,186 @@
+#include "ippfleet.h"
+
+#include "ippmsg.h"
+#include "ippprinter.h"
+
+#include <regex>
+
+struct IppFleetPoller::Transfer
+{
+  Transfer() = default;
+  Transfer(const Transfer&) = delete;
+  Transfer& operator=(const Transfer&) = delete;
+  ~Transfer()
+  {
+    curl_slist_free_all(headers);
+    curl_easy_cleanup(curl);
+  }
+
+  Result result;
+  CURL* curl = nullptr;
+  curl_slist* headers = nullptr;
+  Bytestream request;
+  Bytestream response;
+  bool gettingJobs = false;
+};
+
+static size_t append_response(char* ptr, size_t size, size_t nmemb, void* userdata)
+{
+  size_t bytes = size * nmemb;
+  static_cast<Bytestream*>(userdata)->putBytes(ptr, bytes);
+  return bytes;
+}
+
+void IppFleetPoller::poll(const List<Url>& addrs, const ResultFun& resultFun) const
+{
+  CURLM* multi = curl_multi_init();
+  List<Transfer> transfers;
+  List<Url>::const_iterator next = addrs.cbegin();
+
+  while(next != addrs.cend() || !transfers.empty())
+  {
+    while(next != addrs.cend() && transfers.size() < _maxConcurrent)
+    {
+      transfers.emplace_back();
+      Transfer& transfer = transfers.back();
+      transfer.result.addr = *next++;
+      if(!transfer.result.addr.isValid())
+      {
+        transfer.result.error = "Invalid printer address";
+        resultFun(std::move(transfer.result));
+        transfers.pop_back();
+        continue;
+      }
+
+      Url httpAddr = transfer.result.addr;
+      http_url(httpAddr);
+      transfer.curl = curl_easy_init();
+      transfer.headers = CurlRequester::configure(transfer.curl, httpAddr, _sslConfig);
+      transfer.headers = curl_slist_append(transfer.headers, "Expect:");
+      transfer.headers = curl_slist_append(transfer.headers, "Content-Type: application/ipp");
+      transfer.headers = curl_slist_append(transfer.headers, "Accept-Encoding: identity");
+      curl_easy_setopt(transfer.curl, CURLOPT_HTTPHEADER, transfer.headers);
+      curl_easy_setopt(transfer.curl, CURLOPT_POST, 1L);
+      curl_easy_setopt(transfer.curl, CURLOPT_TIMEOUT_MS, _timeoutMs);
+      curl_easy_setopt(transfer.curl, CURLOPT_WRITEFUNCTION, append_response);
+      curl_easy_setopt(transfer.curl, CURLOPT_WRITEDATA, &transfer.response);
+      curl_easy_setopt(transfer.curl, CURLOPT_PRIVATE, &transfer);
+      start(multi, transfer, IppMsg::GetPrinterAttrs);
+    }
+
+    int running = 0;
+    curl_multi_perform(multi, &running);
+
+    int queued = 0;
+    while(CURLMsg* msg = curl_multi_info_read(multi, &queued))
+    {
+      if(msg->msg != CURLMSG_DONE)
+      {
+        continue;
+      }
+      // The message is gone once the handle is removed
+      CURL* curl = msg->easy_handle;
+      CURLcode result = msg->data.result;
+      Transfer* transfer = nullptr;
+      curl_easy_getinfo(curl, CURLINFO_PRIVATE, &transfer);
+      curl_multi_remove_handle(multi, curl);
+
+      if(handleResponse(multi, *transfer, result))
+      {
+        resultFun(std::move(transfer->result));
+        transfers.remove_if([transfer](const Transfer& t){return &t == transfer;});
+      }
+    }
+
+    if(running != 0)
+    {
+      curl_multi_poll(multi, nullptr, 0, 1000, nullptr);
+    }
+  }
+  curl_multi_cleanup(multi);
+}
+
+void IppFleetPoller::start(CURLM* multi, Transfer& transfer, uint16_t operation) const
+{
+  IppAttrs opAttrs = IppMsg::baseOpAttrs(transfer.result.addr.localUrl());
+  IppOneSetOf requested = operation == IppMsg::GetJobs
+                        ? IppPrinter::JobInfo::requestedAttributes()
+                        : IppPrinter::requestedAttributes(IppPrinter::StatusProfile);
+  opAttrs.set("requested-attributes", IppAttr(IppTag::Keyword, requested));
+  IppMsg req(operation, opAttrs);
+  if(transfer.result.printerAttrs.getList<std::string>("ipp-versions-supported").contains("2.0"))
+  {
+    req.setVersion(2, 0);
+  }
+
+  transfer.request = req.encode();
+  transfer.response = Bytestream();
+  curl_easy_setopt(transfer.curl, CURLOPT_POSTFIELDS, transfer.request.raw());
+  curl_easy_setopt(transfer.curl, CURLOPT_POSTFIELDSIZE, long(transfer.request.size()));
+  curl_multi_add_handle(multi, transfer.curl);
+}
+
+// Returns true when the printer is done, or else starts its next request
+bool IppFleetPoller::handleResponse(CURLM* multi, Transfer& transfer, CURLcode result) const
+{
+  if(!readResponse(transfer.result, result, transfer.response, transfer.gettingJobs)
+     || transfer.gettingJobs || !_getJobs)
+  {
+    return true;
+  }
+
+  // Same handle, so the connection is reused
+  transfer.gettingJobs = true;
+  start(multi, transfer, IppMsg::GetJobs);
+  return false;
+}
+
+bool IppFleetPoller::readResponse(Result& result, CURLcode curlResult, Bytestream& response, bool jobs)
+{
+  if(curlResult != CURLE_OK)
+  {
+    result.error = curl_easy_strerror(curlResult);
+    return false;
+  }
+
+  IppMsg resp;
+  try
+  {
+    resp = IppMsg(response);
+  }
+  catch(const std::exception& e)
+  {
+    result.error = e.what();
+    return false;
+  }
+  if(resp.getStatus() > 0xff)
+  {
+    result.error = resp.getOpAttrs().get<std::string>("status-message", "unknown");
+    return false;
+  }
+
+  if(jobs)
+  {
+    result.jobs.splice(result.jobs.end(), resp.getJobAttrs());
+  }
+  else
+  {
+    result.printerAttrs = resp.getPrinterAttrs();
+  }
+  return true;
+}
+
+List<Url> read_url_list(std::istream& in)
+{
+  List<Url> addrs;
+  std::string line;
+  while(std::getline(in, line))
+  {
+    line = std::regex_replace(line, std::regex("^\\s+|\\s+$"), "");
+    if(!line.empty() && line[0] != '#')
+    {
+      addrs.push_back(Url(line));
+    }
+  }
+  return addrs;
+}
@@ -0,0 +1,73 @@
+#ifndef IPPFLEET_H
+#define IPPFLEET_H
+
+#include "curlrequester.h"
+#include "error.h"
+#include "ippattr.h"
+#include "list.h"
+#include "url.h"
+
+#include <functional>
+#include <istream>
+
+// Polls many printers at once from one curl multi loop on the calling thread,
+// rather than one blocking request and thread per printer like IppPrinter
+class IppFleetPoller
+{
+public:
+  struct Result
+  {
+    Url addr;
+    Error error;
+    // Only the state attributes, and the IPP versions supported
+    IppAttrs printerAttrs;
+    List<IppAttrs> jobs;
+  };
+  using ResultFun = std::function<void(Result&&)>;
+
+  static constexpr size_t DefaultMaxConcurrent = 32;
+  static constexpr long DefaultTimeoutMs = 5000;
+
+  IppFleetPoller(SslConfig sslConfig = SslConfig()) : _sslConfig(std::move(sslConfig))
+  {}
+
+  // Also ask each printer for its jobs, after its attributes
+  void setGetJobs(bool getJobs)
+  {
+    _getJobs = getJobs;
+  }
+  // How many printers are talked to at a time
+  void setMaxConcurrent(size_t maxConcurrent)
+  {
+    _maxConcurrent = maxConcurrent != 0 ? maxConcurrent : 1;
+  }
+  // Limit for each request, including connecting
+  void setTimeout(long timeoutMs)
+  {
+    _timeoutMs = timeoutMs;
+  }
+
+  // Blocks until every printer has answered, failed or timed out.
+  // resultFun is called for each printer as soon as it is done, in no particular order.
+  void poll(const List<Url>& addrs, const ResultFun& resultFun) const;
+
+  // Takes the attributes (or jobs) from one response into result,
+  // or sets its error and returns false
+  static bool readResponse(Result& result, CURLcode curlResult, Bytestream& response, bool jobs);
+
+private:
+  struct Transfer;
+
+  void start(CURLM* multi, Transfer& transfer, uint16_t operation) const;
+  bool handleResponse(CURLM* multi, Transfer& transfer, CURLcode result) const;
+
+  SslConfig _sslConfig;
+  bool _getJobs = false;
+  size_t _maxConcurrent = DefaultMaxConcurrent;
+  long _timeoutMs = DefaultTimeoutMs;
+};
+
+// One address per line, skipping blank lines and #-comments
+List<Url> read_url_list(std::istream& in);
+
+#endif // IPPFLEET_H
@@ -1,13 +1,35 @@
 #include "ippprinter.h"
 
+#include "compressiontuner.h"
 #include "configdir.h"
+#include "holdingwriter.h"
 #include "log.h"
+#include "lthread.h"
 #include "stringutils.h"
 
 #include <filesystem>
 
-IppPrinter::IppPrinter(Url addr, SslConfig sslConfig)
-: _addr(std::move(addr)), _sslConfig(std::move(sslConfig))
+// Attributes to set, by the value of an attribute to match on
+static Json load_overrides()
+{
+  std::ifstream ifs(CONFIG_DIR + "/overrides", std::ios::in | std::ios::binary);
+  if(!ifs)
+  {
+    return Json();
+  }
+  Bytestream bts(ifs);
+  std::string errStr;
+  Json overridesJson = Json::parse(bts.getString(bts.size()), errStr);
+  if(!errStr.empty())
+  {
+    WARN(<< "Bad overrides file: " << errStr);
+  }
+  return overridesJson;
+}
+
+IppPrinter::IppPrinter(Url addr, SslConfig sslConfig, bool cacheAttrs, Profile profile)
+: _addr(std::move(addr)), _sslConfig(std::move(sslConfig)),
+  _session(std::make_shared<CurlSession>()), _cacheAttrs(cacheAttrs), _profile(profile)
 {
   _error = refresh();
 }
@@ -15,6 +37,7 @@ IppPrinter::IppPrinter(Url addr, SslConfig sslConfig)
 Error IppPrinter::refresh()
 {
   Error error;
+  Json overridesJson = load_overrides();
   if(!_addr.isValid())
   {
     return Error("Invalid printer address.");
@@ -50,13 +73,33 @@ Error IppPrinter::refresh()
       error = e.what();
     }
   }
-  else
+  else if(_profile != FullProfile)
+  {
+    IppOneSetOf requested = requestedAttributes(_profile);
+    // Overrides can only apply if what they match on is there
+    for(const auto& [matchAttrName, matchAttr] : overridesJson.object_items())
+    {
+      if(!requested.contains(matchAttrName))
+      {
+        requested.push_back(matchAttrName);
+      }
+    }
+    IppAttrs opAttrs = {{"requested-attributes", IppAttr(IppTag::Keyword, requested)}};
+    IppMsg resp;
+    error = _doRequest(_mkMsg(IppMsg::GetPrinterAttrs, opAttrs), resp);
+    _printerAttrs = resp.getPrinterAttrs();
+  }
+  else if(!_cacheAttrs || !_refreshFromCache(error))
   {
     IppMsg resp;
     error = _doRequest(IppMsg::GetPrinterAttrs, resp);
     _printerAttrs = resp.getPrinterAttrs();
+    if(!error && _cacheAttrs)
+    {
+      saveCache(cachePath(_addr), _printerAttrs);
+    }
   }
-  _applyOverrides();
+  _applyOverrides(overridesJson);
   return error;
 }
 
@@ -64,6 +107,7 @@ Error IppPrinter::runJob(IppPrintJob& job, const std::string& inFile, const std:
                          int pages, const ProgressFun& progressFun)
 {
   Error error;
+  _uploadStats.reset();
   try
   {
     List<int> supportedOperations = _printerAttrs.getList<int>("operations-supported");
@@ -94,42 +138,36 @@ Error IppPrinter::runJob(IppPrintJob& job, const std::string& inFile, const std:
       {
         IppAttrs createJobOpAttrs = {{"job-name", {IppTag::NameWithoutLanguage, fileName}}};
         IppMsg createJobMsg = _mkMsg(IppMsg::CreateJob, createJobOpAttrs, job.jobAttrs);
-        IppMsg createJobResp;
-        error = _doRequest(createJobMsg, createJobResp);
-
-        if(error)
+        IppAttrs sendDocumentOpAttrs = job.opAttrs;
+
+        // Create-Job runs while the converter gets going,
+        // and the document follows as soon as the job id is known
+        std::promise<IppMsg> sendDocMsg;
+        std::future<IppMsg> sendDocMsgFuture = sendDocMsg.get_future();
+        LThread creator;
+        creator.run([this, &createJobMsg, &sendDocumentOpAttrs, &sendDocMsg]()
         {
-          error = std::string("Create job failed: ") + error.value();
-        }
-        else
-        {
-          IppAttrs createJobRespJobAttrs;
-          if(!createJobResp.getJobAttrs().empty())
-          {
-            createJobRespJobAttrs = createJobResp.getJobAttrs().front();
-          }
-          if(createJobResp.getStatus() <= 0xff && createJobRespJobAttrs.has("job-id"))
+          try
           {
-            int jobId = createJobRespJobAttrs.get<int>("job-id");
-            IppAttrs sendDocumentOpAttrs = job.opAttrs;
+            int jobId = _createJob(createJobMsg);
             sendDocumentOpAttrs.set("job-id", IppAttr {IppTag::Integer, jobId});
             sendDocumentOpAttrs.set("last-document", IppAttr {IppTag::Boolean, true});
-            IppMsg sendDocMsg = _mkMsg(IppMsg::SendDocument, sendDocumentOpAttrs);
-            error = doPrint(job, inFile, sendDocMsg.encode(), convertFun.value(), progressFun);
+            sendDocMsg.set_value(_mkMsg(IppMsg::SendDocument, sendDocumentOpAttrs));
           }
-          else
+          catch(...)
           {
-            error = "Create job failed: "
-                  + createJobResp.getOpAttrs().get<std::string>("status-message", "unknown");
+            sendDocMsg.set_exception(std::current_exception());
           }
-        }
+        });
+        error = doPrint(job, inFile, std::move(sendDocMsgFuture), convertFun.value(), progressFun);
       }
       else
       {
         IppAttrs printJobOpAttrs = job.opAttrs;
         printJobOpAttrs.set("job-name", IppAttr {IppTag::NameWithoutLanguage, fileName});
-        IppMsg printJobMsg = _mkMsg(IppMsg::PrintJob, printJobOpAttrs, job.jobAttrs);
-        error = doPrint(job, inFile, printJobMsg.encode(), convertFun.value(), progressFun);
+        std::promise<IppMsg> printJobMsg;
+        printJobMsg.set_value(_mkMsg(IppMsg::PrintJob, printJobOpAttrs, job.jobAttrs));
+        error = doPrint(job, inFile, printJobMsg.get_future(), convertFun.value(), progressFun);
       }
     }
   }
@@ -140,39 +178,128 @@ Error IppPrinter::runJob(IppPrintJob& job, const std::string& inFile, const std:
   return error;
 }
 
-Error IppPrinter::doPrint(IppPrintJob& job, const std::string& inFile, Bytestream&& hdr,
+// Throws if the job could not be created
+int IppPrinter::_createJob(const IppMsg& createJobMsg) const
+{
+  IppMsg createJobResp;
+  Error error = _doRequest(createJobMsg, createJobResp);
+  if(error)
+  {
+    throw std::runtime_error("Create job failed: " + error.value());
+  }
+  IppAttrs createJobRespJobAttrs;
+  if(!createJobResp.getJobAttrs().empty())
+  {
+    createJobRespJobAttrs = createJobResp.getJobAttrs().front();
+  }
+  if(createJobResp.getStatus() > 0xff || !createJobRespJobAttrs.has("job-id"))
+  {
+    throw std::runtime_error("Create job failed: "
+                             + createJobResp.getOpAttrs().get<std::string>("status-message",
+                                                                           "unknown"));
+  }
+  return createJobRespJobAttrs.get<int>("job-id");
+}
+
+Error IppPrinter::doPrint(IppPrintJob& job, const std::string& inFile, std::future<IppMsg> msgFuture,
                           const Converter::ConvertFun& convertFun, const ProgressFun& progressFun)
 {
   Error error;
-  CurlIppStreamer cr(_addr, _sslConfig);
-  cr.write(std::move(hdr));
+  // Made once the request is known, so it can reuse the connection Create-Job used
+  std::optional<CurlIppStreamer> cr;
 
+  CurlIppStreamer::Compression compression = CurlIppStreamer::NoCompression;
   if(job.compression.get() == "gzip")
   {
-    cr.setCompression(CurlIppStreamer::Gzip);
+    compression = CurlIppStreamer::Gzip;
   }
   else if(job.compression.get() == "deflate")
   {
-    cr.setCompression(CurlIppStreamer::Deflate);
+    compression = CurlIppStreamer::Deflate;
   }
 
-  WriteFun writeFun([&cr](Bytestream&& data) -> bool
+  // The start of the document is held back until the request is known,
+  // and with compression also for a trial run, as the header needs to say
+  // if it is compressed after all
+  CompressionTuner tuner(job.targetFormat);
+  auto msgReady = [&msgFuture]()
+  {
+    return msgFuture.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+  };
+  auto begin = [&]() -> bool
+  {
+    IppMsg msg;
+    try
+    {
+      msg = msgFuture.get();
+    }
+    catch(const std::exception& e)
+    {
+      error = e.what();
+      return false;
+    }
+    cr.emplace(_addr, _sslConfig, _session);
+
+    if(compression != CurlIppStreamer::NoCompression)
+    {
+      CompressionChoice choice = tuner.choose();
+      if(choice.enabled)
+      {
+        DBG(<< "Compressing with " << job.compression.get() << ", level " << choice.level
+            << ", " << CompressionTuner::strategyName(choice.strategy)
+            << " strategy, trial ratio " << choice.ratio);
+        cr->write(msg.encode());
+        cr->setCompression(compression, choice.level, choice.strategy);
+      }
+      else
+      {
+        DBG(<< "Not compressing, " << choice.reason << ", trial ratio " << choice.ratio);
+        msg.setOpAttr("compression", IppAttr(IppTag::Keyword, "none"));
+        cr->write(msg.encode());
+      }
+    }
+    else
+    {
+      cr->write(msg.encode());
+    }
+    return true;
+  };
+  // Past the limit, converting waits for the request to be known
+  HoldingWriter holder(msgReady, begin,
+                       [&cr](Bytestream&& data){return cr->write(std::move(data));},
+                       MaxHeldBytes);
+
+  if(compression == CurlIppStreamer::NoCompression && msgReady())
+  {
+    holder.start();
+  }
+
+  WriteFun writeFun([&](Bytestream&& data) -> bool
            {
-             if(data.size() == 0)
-             {
-               return true;
-             }
-             return cr.write(std::move(data));
+             bool sampled = holder.started() || data.size() == 0
+                         || compression == CurlIppStreamer::NoCompression
+                         || tuner.addSample(data);
+             return holder.write(std::move(data), sampled);
            });
 
-  error = convertFun(inFile, job, writeFun, progressFun);
-  if(error)
+  Error convertError = convertFun(inFile, job, writeFun, progressFun);
+  if(convertError && !holder.started())
+  {
+    // Create-Job may have gone through meanwhile, don't leave an empty job behind
+    _cancelCreatedJob(msgFuture);
+  }
+  if(error || convertError)
+  {
+    return error ? error : convertError;
+  }
+  if(!holder.start())
   {
     return error;
   }
 
   Bytestream result;
-  CURLcode cres = cr.await(&result);
+  CURLcode cres = cr->await(&result);
+  _uploadStats = cr->stats();
   if(cres == CURLE_OK)
   {
     IppMsg response(result);
@@ -198,6 +325,31 @@ Error IppPrinter::doPrint(IppPrintJob& job, const std::string& inFile, Bytestrea
   return error;
 }
 
+void IppPrinter::_cancelCreatedJob(std::future<IppMsg>& msgFuture) const
+{
+  IppAttrs opAttrs;
+  try
+  {
+    opAttrs = msgFuture.get().getOpAttrs();
+  }
+  catch(const std::exception& e)
+  {
+    DBG(<< "No job to cancel: " << e.what());
+    return;
+  }
+  // Print-Job carries no job id, and has not been sent
+  if(opAttrs.has("job-id"))
+  {
+    int jobId = opAttrs.get<int>("job-id");
+    DBG(<< "Canceling job " << jobId << ", as its document could not be made");
+    Error error = cancelJob(jobId);
+    if(error)
+    {
+      WARN(<< "Failed to cancel job " << jobId << ": " << error.value());
+    }
+  }
+}
+
 Error IppPrinter::doPrintToFile(IppPrintJob& job, const std::string& inFile,
                                 const Converter::ConvertFun& convertFun,
                                 const ProgressFun& progressFun)
@@ -410,6 +562,28 @@ bool IppPrinter::supportsPrinterRaster() const
   return formats.contains(MiniMime::PWG) || formats.contains(MiniMime::URF);
 }
 
+IppOneSetOf IppPrinter::JobInfo::requestedAttributes()
+{
+  return {"job-id", "job-name", "job-state", "job-printer-state-message"};
+}
+
+IppOneSetOf IppPrinter::requestedAttributes(Profile profile)
+{
+  // The IPP version to use for further requests is needed by all
+  switch(profile)
+  {
+    case StatusProfile:
+      return {"ipp-versions-supported", "printer-state", "printer-state-reasons",
+              "printer-state-message"};
+    case JobsProfile:
+      return {"ipp-versions-supported"};
+    case IdentifyProfile:
+      return {"ipp-versions-supported", "identify-actions-supported"};
+    default:
+      return {};
+  }
+}
+
 int IppPrinter::Supply::getPercent() const
 {
   return (level*100.0)/(highLevel != 0 ? highLevel : 100);
@@ -490,7 +664,8 @@ Error IppPrinter::setAttributes(const List<std::pair<std::string, std::string>>&
 
 Error IppPrinter::getJobs(List<IppPrinter::JobInfo>& jobInfos) const
 {
-  IppAttrs getJobsOpAttrs = {{"requested-attributes", {IppTag::Keyword, "all"}}};
+  IppAttrs getJobsOpAttrs = {{"requested-attributes",
+                              IppAttr(IppTag::Keyword, JobInfo::requestedAttributes())}};
   IppMsg req = _mkMsg(IppMsg::GetJobs, getJobsOpAttrs);
   IppMsg resp;
   Error error = _doRequest(req, resp);
@@ -544,7 +719,7 @@ Error IppPrinter::_doRequest(const IppMsg& req, IppMsg& resp) const
   }
   DBG(<< "Printer attrs: " << req.getPrinterAttrs().toJSON().dump());
 
-  CurlIppPoster reqPoster(_addr, req.encode(), _sslConfig);
+  CurlIppPoster reqPoster(_addr, req.encode(), _sslConfig, _session);
   Bytestream respBts;
   CURLcode res0 = reqPoster.await(&respBts);
   if(res0 == CURLE_OK)
@@ -575,7 +750,7 @@ Error IppPrinter::_doRequest(const IppMsg& req, IppMsg& resp) const
 IppMsg IppPrinter::_mkMsg(uint16_t opOrStatus, IppAttrs opAttrs,
                           const IppAttrs& jobAttrs, const IppAttrs& printerAttrs) const
 {
-  IppAttrs baseOpAttrs = IppMsg::baseOpAttrs(_addr);
+  IppAttrs baseOpAttrs = IppMsg::baseOpAttrs(_addr.localUrl());
   opAttrs.insert(baseOpAttrs.cbegin(), baseOpAttrs.cend());
 
   IppMsg msg(opOrStatus, opAttrs, jobAttrs, printerAttrs);
@@ -586,32 +761,169 @@ IppMsg IppPrinter::_mkMsg(uint16_t opOrStatus, IppAttrs opAttrs,
   return msg;
 }
 
-void IppPrinter::_applyOverrides()
+// Printer attributes that change without the configuration changing,
+// so they are always asked for even when the rest comes from the cache
+static const IppOneSetOf VolatileAttributes =
+  {"printer-state", "printer-state-reasons", "printer-state-message", "printer-state-change-time",
+   "printer-is-accepting-jobs", "printer-alert", "printer-alert-description", "printer-up-time",
+   "printer-current-time", "queued-job-count", "marker-names", "marker-types", "marker-colors",
+   "marker-levels", "marker-low-levels", "marker-high-levels", "printer-supply",
+   "printer-supply-description", "printer-input-tray", "printer-output-tray", "media-ready",
+   "media-col-ready"};
+
+// One file per printer address, with anything but letters, digits, dots and dashes %-escaped
+std::filesystem::path IppPrinter::cachePath(const Url& addr)
+{
+  std::string name;
+  for(unsigned char c : addr.toStr())
+  {
+    if(std::isalnum(c) || c == '.' || c == '-')
+    {
+      name += c;
+    }
+    else
+    {
+      static const char* hex = "0123456789ABCDEF";
+      name += {'%', hex[c >> 4], hex[c & 0xf]};
+    }
+  }
+  return std::filesystem::path(CONFIG_DIR) / "printer_cache" / name;
+}
+
+bool IppPrinter::loadCache(const std::filesystem::path& path, IppAttrs& attrs)
 {
   try
   {
-    std::ifstream ifs(CONFIG_DIR + "/overrides", std::ios::in | std::ios::binary);
-    if(ifs)
+    std::ifstream ifs(path, std::ios::in | std::ios::binary);
+    if(!ifs)
     {
-      Bytestream bts(ifs);
-      std::string errStr;
-      Json overridesJson = Json::parse(bts.getString(bts.size()), errStr);
-      if(!errStr.empty())
-      {
-        WARN(<< "Bad overrides file: " << errStr);
-      }
-      for(const auto& [matchAttrName, matchAttr] : overridesJson.object_items())
+      return false;
+    }
+    Bytestream bts(ifs);
+    std::string errStr;
+    Json json = Json::parse(bts.getString(bts.size()), errStr);
+    if(!errStr.empty())
+    {
+      return false;
+    }
+    attrs = IppAttrs::fromJSON(json.object_items());
+  }
+  catch(const std::exception& e)
+  {
+    DBG(<< "Bad printer attribute cache: " << e.what());
+    return false;
+  }
+  return attrs.has("printer-config-change-time");
+}
+
+bool IppPrinter::saveCache(const std::filesystem::path& path, const IppAttrs& attrs)
+{
+  if(!attrs.has("printer-config-change-time"))
+  {
+    return false;
+  }
+  std::filesystem::path tmpPath = path.string() + ".tmp";
+  std::error_code ec;
+  std::filesystem::create_directories(path.parent_path(), ec);
+  // Written aside and moved in place, so others never see half a file
+  {
+    std::ofstream ofs(tmpPath, std::ios::out | std::ios::binary | std::ios::trunc);
+    ofs << attrs.toJSON().dump();
+    if(!ofs)
+    {
+      DBG(<< "Failed to write printer attribute cache");
+      return false;
+    }
+  }
+  std::filesystem::rename(tmpPath, path, ec);
+  return !ec;
+}
+
+IppOneSetOf IppPrinter::cacheValidationAttributes()
+{
+  IppOneSetOf requested = requestedAttributes(StatusProfile);
+  for(const IppValue& name : VolatileAttributes)
+  {
+    if(!requested.contains(name))
+    {
+      requested.push_back(name);
+    }
+  }
+  requested.push_back("printer-config-change-time");
+  requested.push_back("printer-uuid");
+  return requested;
+}
+
+std::optional<IppAttrs> IppPrinter::validateCache(IppAttrs cached, const IppAttrs& current)
+{
+  if(!current.has("printer-config-change-time")
+     || current.get<int>("printer-config-change-time")
+        != cached.get<int>("printer-config-change-time")
+     || current.get<std::string>("printer-uuid") != cached.get<std::string>("printer-uuid"))
+  {
+    return {};
+  }
+  // Whatever the printer no longer reports, like a cleared alert, is gone
+  for(const IppValue& name : VolatileAttributes)
+  {
+    cached.erase(name.get<std::string>());
+  }
+  for(const auto& [name, attr] : current)
+  {
+    cached.insert_or_assign(name, attr);
+  }
+  return cached;
+}
+
+// Returns false if there is nothing usable cached and a full refresh is needed
+bool IppPrinter::_refreshFromCache(Error& error)
+{
+  IppAttrs cachedAttrs;
+  if(!loadCache(cachePath(_addr), cachedAttrs))
+  {
+    return false;
+  }
+
+  // The cached attributes decide the IPP version to ask with
+  _printerAttrs = cachedAttrs;
+  IppAttrs opAttrs = {{"requested-attributes",
+                       IppAttr(IppTag::Keyword, cacheValidationAttributes())}};
+  IppMsg resp;
+  error = _doRequest(_mkMsg(IppMsg::GetPrinterAttrs, opAttrs), resp);
+  if(error)
+  {
+    _printerAttrs = IppAttrs();
+    return true;
+  }
+
+  std::optional<IppAttrs> validAttrs = validateCache(std::move(cachedAttrs), resp.getPrinterAttrs());
+  if(!validAttrs)
+  {
+    DBG(<< "Printer configuration changed, not using cached attributes");
+    _printerAttrs = IppAttrs();
+    return false;
+  }
+
+  DBG(<< "Using cached printer attributes");
+  _printerAttrs = std::move(*validAttrs);
+  return true;
+}
+
+void IppPrinter::_applyOverrides(const Json& overridesJson)
+{
+  try
+  {
+    for(const auto& [matchAttrName, matchAttr] : overridesJson.object_items())
+    {
+      for(const auto& [matchAttrValue, overrideObj] : matchAttr.object_items())
       {
-        for(const auto& [matchAttrValue, overrideObj] : matchAttr.object_items())
+        if(_printerAttrs.hasWithValue(matchAttrName, matchAttrValue))
         {
-          if(_printerAttrs.hasWithValue(matchAttrName, matchAttrValue))
+          IppAttrs overrideAttrs = IppAttrs::fromJSON(overrideObj.object_items());
+          DBG(<< "Overriding printer attributes: " << overrideAttrs.toJSON().dump());
+          for(const auto& [name, attr] : overrideAttrs)
           {
-            IppAttrs overrideAttrs = IppAttrs::fromJSON(overrideObj.object_items());
-            DBG(<< "Overriding printer attributes: " << overrideAttrs.toJSON().dump());
-            for(const auto& [name, attr] : overrideAttrs)
-            {
-              _printerAttrs.insert_or_assign(name, attr);
-            }
+            _printerAttrs.insert_or_assign(name, attr);
           }
         }
       }
@@ -8,6 +8,9 @@
 #include "ippmsg.h"
 #include "ippprintjob.h"
 
+#include <filesystem>
+#include <future>
+#include <optional>
 #include <string>
 
 class IppPrinter
@@ -37,9 +40,36 @@ public:
     std::string name;
     int state = 0;
     std::string stateMessage;
+    // What Get-Jobs needs to return to fill these in
+    static IppOneSetOf requestedAttributes();
   };
 
-  IppPrinter(Url addr, SslConfig sslConfig);
+  // How much refresh() asks the printer for. Anything but FullProfile is for quick
+  // requests that only need a few attributes, and is not cached.
+  enum Profile
+  {
+    FullProfile,
+    StatusProfile,
+    JobsProfile,
+    IdentifyProfile
+  };
+  // The requested-attributes for a profile, empty for FullProfile which gets everything
+  static IppOneSetOf requestedAttributes(Profile profile);
+
+  // The attribute cache used with cacheAttrs, one file per printer under CONFIG_DIR
+  static std::filesystem::path cachePath(const Url& addr);
+  // Only caches with printer-config-change-time are usable, as that is what validates them
+  static bool loadCache(const std::filesystem::path& path, IppAttrs& attrs);
+  static bool saveCache(const std::filesystem::path& path, const IppAttrs& attrs);
+  // What to ask for to check a cache, and to update what changes without the configuration
+  static IppOneSetOf cacheValidationAttributes();
+  // The cached attributes updated with the current ones, or nothing if the printer's
+  // configuration or identity has changed since they were cached
+  static std::optional<IppAttrs> validateCache(IppAttrs cached, const IppAttrs& current);
+
+  // With cacheAttrs, attributes saved by an earlier run are reused if the printer's
+  // configuration has not changed since, which only takes a small request to check
+  IppPrinter(Url addr, SslConfig sslConfig, bool cacheAttrs = false, Profile profile = FullProfile);
   IppPrinter(IppAttrs printerAttrs) : _printerAttrs(std::move(printerAttrs))
   {}
   Error refresh();
@@ -103,6 +133,15 @@ public:
     _printJobId = printJobId;
   }
 
+  // For the last document runJob() sent to the printer, nothing if it did not upload one
+  std::optional<CurlIppPosterBase::UploadStats> uploadStats() const
+  {
+    return _uploadStats;
+  }
+
+  // How much converted data is held while waiting for Create-Job
+  static constexpr size_t MaxHeldBytes = 16 * 1024 * 1024;
+
 private:
   Error _doRequest(IppMsg::Operation op, IppMsg& resp) const;
   Error _doRequest(const IppMsg& req, IppMsg& resp) const;
@@ -110,16 +149,25 @@ private:
                 IppAttrs opAttrs=IppAttrs(),
                 const IppAttrs& jobAttrs=IppAttrs(),
                 const IppAttrs& printerAttrs=IppAttrs()) const;
-  void _applyOverrides();
+  int _createJob(const IppMsg& createJobMsg) const;
+  // Waits for Create-Job, and cancels the job if it was created
+  void _cancelCreatedJob(std::future<IppMsg>& msgFuture) const;
+  void _applyOverrides(const Json& overridesJson);
+  bool _refreshFromCache(Error& error);
 
   Url _addr;
   SslConfig _sslConfig;
+  // Keeps the connection to the printer open between requests
+  std::shared_ptr<CurlSession> _session;
+  bool _cacheAttrs = false;
+  Profile _profile = FullProfile;
   bool _printJobId = false;
 
   Error _error;
   IppAttrs _printerAttrs;
+  std::optional<CurlIppPosterBase::UploadStats> _uploadStats;
 
-  Error doPrint(IppPrintJob& job, const std::string& inFile, Bytestream&& hdr,
+  Error doPrint(IppPrintJob& job, const std::string& inFile, std::future<IppMsg> msgFuture,
                 const Converter::ConvertFun& convertFun, const ProgressFun& progressFun);
   Error doPrintToFile(IppPrintJob& job, const std::string& inFile,
                       const Converter::ConvertFun& convertFun, const ProgressFun& progressFun);
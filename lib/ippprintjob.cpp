@@ -71,7 +71,8 @@ Error IppPrintJob::finalize(const std::string& inputFormat, int pages)
     media.unset();
   }
 
-  if(inputFormat == MiniMime::PDF)
+  // PDF and JPEG are converted locally, so those need to know the format
+  if(inputFormat == MiniMime::PDF || inputFormat == MiniMime::JPEG)
   {
     if(targetFormat == MiniMime::PDF)
     {
@@ -112,7 +113,11 @@ Error IppPrintJob::finalize(const std::string& inputFormat, int pages)
       printParams.pageSelection.push_back({range.low, range.high});
     }
     pageRanges.unset();
+  }
 
+  // Scaling is also effected locally for JPEG that gets rasterized
+  if(inputFormat == MiniMime::PDF || (inputFormat == MiniMime::JPEG && printParams.isRasterFormat()))
+  {
     if(scaling.isSet())
     {
       if(scaling.get() == "auto")
@@ -224,66 +229,75 @@ uint32_t absdiff(uint32_t a, uint32_t b)
   return a > b ? a - b : b - a;
 }
 
-void IppPrintJob::adjustRasterSettings(int pages)
+List<IppResolution> IppPrintJob::supportedRasterResolutions() const
 {
-  if(!printParams.isRasterFormat())
-  {
-    return;
-  }
+  return supportedRasterResolutions(printParams.format == PrintParameters::PWG ? MiniMime::PWG
+                                    : printParams.format == PrintParameters::URF ? MiniMime::URF
+                                    : "");
+}
 
-  resolution.unset();
+List<IppResolution> IppPrintJob::supportedRasterResolutions(const std::string& rasterFormat) const
+{
+  List<IppResolution> resolutions;
 
-  if(printParams.format == PrintParameters::PWG)
+  if(rasterFormat == MiniMime::PWG)
   {
-    uint32_t diff = std::numeric_limits<uint32_t>::max();
-    uint32_t AdjustedHwResX = printParams.hwResW;
-    uint32_t AdjustedHwResY = printParams.hwResH;
-
     for(const IppResolution& res : _printerAttrs.getList<IppResolution>("pwg-raster-document-resolution-supported"))
     {
-      if(res.units != IppResolution::DPI)
+      if(res.units == IppResolution::DPI)
       {
-        continue;
-      }
-      uint32_t tmpDiff = absdiff(printParams.hwResW, res.x) + absdiff(printParams.hwResH, res.y);
-      if(tmpDiff < diff)
-      {
-        diff = tmpDiff;
-        AdjustedHwResX = res.x;
-        AdjustedHwResY = res.y;
+        resolutions.push_back(res);
       }
     }
-    printParams.hwResW = AdjustedHwResX;
-    printParams.hwResH = AdjustedHwResY;
   }
-  else if(printParams.format == PrintParameters::URF)
-  { // Ensure symmetric resolution for URF
-    printParams.hwResW = printParams.hwResH = std::min(printParams.hwResW, printParams.hwResH);
-
-    uint32_t diff = std::numeric_limits<uint32_t>::max();
-    uint32_t AdjustedHwRes = printParams.hwResW;
-    List<std::string> urfSupported = _printerAttrs.getList<std::string>("urf-supported");
-
-    for(const std::string& us : urfSupported)
+  else if(rasterFormat == MiniMime::URF)
+  {
+    for(const std::string& us : _printerAttrs.getList<std::string>("urf-supported"))
     {
       if(string_starts_with(us, "RS"))
       { //RS300[-600]
-        List<std::string> rs = split_string(us.substr(2), "-");
-        for(const std::string& r : rs)
+        for(const std::string& r : split_string(us.substr(2), "-"))
         {
-          int intRes = std::stoi(r);
-          uint32_t tmpDiff = absdiff(printParams.hwResW, intRes);
-          if(tmpDiff < diff)
-          {
-            diff = tmpDiff;
-            AdjustedHwRes = intRes;
-          }
+          uint32_t intRes = std::stoi(r);
+          resolutions.push_back(IppResolution {intRes, intRes, IppResolution::DPI});
         }
-        printParams.hwResW = printParams.hwResH = AdjustedHwRes;
         break;
       }
     }
   }
+  return resolutions;
+}
+
+void IppPrintJob::adjustRasterSettings(int pages)
+{
+  if(!printParams.isRasterFormat())
+  {
+    return;
+  }
+
+  resolution.unset();
+
+  if(printParams.format == PrintParameters::URF)
+  { // Ensure symmetric resolution for URF
+    printParams.hwResW = printParams.hwResH = std::min(printParams.hwResW, printParams.hwResH);
+  }
+
+  uint32_t diff = std::numeric_limits<uint32_t>::max();
+  uint32_t AdjustedHwResX = printParams.hwResW;
+  uint32_t AdjustedHwResY = printParams.hwResH;
+
+  for(const IppResolution& res : supportedRasterResolutions())
+  {
+    uint32_t tmpDiff = absdiff(printParams.hwResW, res.x) + absdiff(printParams.hwResH, res.y);
+    if(tmpDiff < diff)
+    {
+      diff = tmpDiff;
+      AdjustedHwResX = res.x;
+      AdjustedHwResY = res.y;
+    }
+  }
+  printParams.hwResW = AdjustedHwResX;
+  printParams.hwResH = AdjustedHwResY;
 
   if(printParams.format == PrintParameters::PWG)
   {
@@ -60,6 +60,11 @@ public:
 
   Error finalize(const std::string& inputFormat, int pages=0);
 
+  // Resolutions the printer accepts for the current raster format
+  List<IppResolution> supportedRasterResolutions() const;
+  // ...or for a raster format given as a MIME type, e.g. when sending raster as-is
+  List<IppResolution> supportedRasterResolutions(const std::string& rasterFormat) const;
+
   bool canSaveSettings();
   void restoreSettings();
   bool saveSettings();
@@ -0,0 +1,352 @@
+#include "jpeg2raster.h"
+
+#include "array.h"
+#include "binfile.h"
+#include "jpegio.h"
+#include "log.h"
+#include "ppm2pwg.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+#include <sstream>
+
+#define SIXTEENTHS(parts, value) (parts*(value/16))
+
+// Turns composed 8-bit gray or RGB lines into lines in the raster color mode
+class RasterLineConverter
+{
+public:
+  RasterLineConverter(const PrintParameters& params)
+  : _colorMode(params.colorMode), _black(params.isBlack()), _width(params.getPaperSizeWInPixels()),
+    _byteWidth(params.getPaperSizeWInBytes()), _outLine(_byteWidth), _debt(_width + 2)
+  {
+    memset(_debt, 0, (_width + 2) * sizeof(int));
+  }
+
+  static size_t inColors(const PrintParameters& params)
+  {
+    return params.getNumberOfColors() == 1 ? 1 : 3;
+  }
+
+  const uint8_t* convert(const uint8_t* in)
+  {
+    uint8_t* out = _outLine;
+    switch(_colorMode)
+    {
+      case PrintParameters::sRGB24:
+      case PrintParameters::Gray8:
+      {
+        return in;
+      }
+      case PrintParameters::Black8:
+      {
+        for(size_t i = 0; i < _width; i++)
+        {
+          out[i] = 255 - in[i];
+        }
+        break;
+      }
+      case PrintParameters::sRGB48:
+      case PrintParameters::Gray16:
+      {
+        for(size_t i = 0; i < _byteWidth / 2; i++)
+        {
+          out[i * 2] = in[i];
+          out[(i * 2) + 1] = in[i];
+        }
+        break;
+      }
+      case PrintParameters::CMYK32:
+      {
+        for(size_t i = 0, j = 0; i < _width * 3; i += 3, j += 4)
+        {
+          uint8_t blackDiff = std::max({in[i], in[i + 1], in[i + 2]});
+          out[j] = blackDiff - in[i];
+          out[j + 1] = blackDiff - in[i + 1];
+          out[j + 2] = blackDiff - in[i + 2];
+          out[j + 3] = 255 - blackDiff;
+        }
+        break;
+      }
+      case PrintParameters::Gray1:
+      case PrintParameters::Black1:
+      {
+        memset(out, _black ? 0 : 0xff, _byteWidth);
+        int nextDebt = 0; // Don't carry over forward debt from previous line
+        for(size_t col = 0; col < _width; col++)
+        { // Same Floyd-Steinberg dithering as for PDFs
+          int pixel = in[col] + nextDebt;
+          int newpixel = pixel < 128 ? 0 : 255;
+          int debt = pixel - newpixel;
+          nextDebt = _debt[col + 2] + SIXTEENTHS(7, debt);
+          _debt[col] += SIXTEENTHS(3, debt);
+          _debt[col + 1] += SIXTEENTHS(5, debt);
+          _debt[col + 2] = SIXTEENTHS(1, debt);
+          if(newpixel == 0)
+          {
+            if(_black)
+            {
+              out[col / 8] |= (0x80 >> (col % 8));
+            }
+            else
+            {
+              out[col / 8] &= ~(0x80 >> (col % 8));
+            }
+          }
+        }
+        break;
+      }
+      default:
+      {
+        throw std::logic_error("Unhandled color mode");
+      }
+    }
+    return out;
+  }
+
+private:
+  PrintParameters::ColorMode _colorMode;
+  bool _black;
+  size_t _width;
+  size_t _byteWidth;
+  Array<uint8_t> _outLine;
+  Array<int> _debt;
+};
+
+// Column or line in the decoded image for each one on the page, -1 for the white margin.
+// The image is centered, and cropped if larger than the page.
+void map_to_page(Array<long>& map, size_t pageSize, size_t scaledSize, size_t decodedSize)
+{
+  long offset = (static_cast<long>(pageSize) - static_cast<long>(scaledSize)) / 2;
+  for(size_t i = 0; i < pageSize; i++)
+  {
+    long pos = static_cast<long>(i) - offset;
+    map[i] = pos < 0 || pos >= static_cast<long>(scaledSize)
+           ? -1 : (((2 * pos) + 1) * decodedSize) / (2 * scaledSize);
+  }
+}
+
+// Encodes one page, with the image scaled to fit and centered, or blank without input
+Error raster_page(std::istream* in, const PrintParameters& params,
+                  Bytestream& outBts, const WriteFun& writeFun)
+{
+  size_t pageWidth = params.getPaperSizeWInPixels();
+  size_t pageHeight = params.getPaperSizeHInPixels();
+  size_t colors = RasterLineConverter::inColors(params);
+  size_t bpc = params.getBitsPerColor();
+  size_t oneChunk = bpc == 1 ? params.getNumberOfColors() : params.getNumberOfColors() * bpc / 8;
+
+  RasterLineConverter converter(params);
+  LineRepeatEncoder encoder(outBts, params.getPaperSizeWInBytes(), oneChunk);
+  Array<uint8_t> pageLine(pageWidth * colors);
+  memset(pageLine, 0xff, pageWidth * colors);
+
+  if(in == nullptr)
+  {
+    const uint8_t* blank = converter.convert(pageLine);
+    for(size_t y = 0; y < pageHeight; y++)
+    {
+      encoder.add(blank);
+    }
+    encoder.flush();
+    return Error();
+  }
+
+  struct jpeg_decompress_struct srcInfo;
+  struct jpeg_error_mgr jSrcErr;
+
+  #if MADNESS
+  #include "libfuncs_jpeg"
+  #include "libfuncs_jpeg_decode"
+  #endif
+
+  srcInfo.err = jpeg_std_error(&jSrcErr);
+  jpeg_create_decompress(&srcInfo);
+
+  stream_source_mgr srcMgr(*in);
+  srcInfo.src = &srcMgr;
+
+  jpeg_read_header(&srcInfo, TRUE);
+
+  // libjpeg won't convert CMYK, so that is done below
+  bool cmyk = srcInfo.jpeg_color_space == JCS_CMYK || srcInfo.jpeg_color_space == JCS_YCCK;
+  bool inverted = cmyk && srcInfo.saw_Adobe_marker;
+  srcInfo.out_color_space = cmyk ? JCS_CMYK : colors == 1 ? JCS_GRAYSCALE : JCS_RGB;
+
+  // Fit (or fill) by physical size, in case the resolution is asymmetric
+  double xScale = static_cast<double>(pageWidth) / params.hwResW / srcInfo.image_width;
+  double yScale = static_cast<double>(pageHeight) / params.hwResH / srcInfo.image_height;
+  bool fill = params.scaling == PrintParameters::Fill || params.scaling == PrintParameters::AutoFill;
+  double scale = fill ? std::max(xScale, yScale) : std::min(xScale, yScale);
+  size_t width = std::max(1L, std::lround(srcInfo.image_width * scale * params.hwResW));
+  size_t height = std::max(1L, std::lround(srcInfo.image_height * scale * params.hwResH));
+
+  // Let the IDCT do as much of the downscaling as possible
+  unsigned int eighths = 1;
+  while(eighths < 8 && ((srcInfo.image_width * eighths) < (width * 8) ||
+                        (srcInfo.image_height * eighths) < (height * 8)))
+  {
+    eighths++;
+  }
+  srcInfo.scale_num = eighths;
+  srcInfo.scale_denom = 8;
+
+  jpeg_start_decompress(&srcInfo);
+
+  DBG(<< "JPEG " << srcInfo.image_width << "x" << srcInfo.image_height << " decoded at "
+      << eighths << "/8 as " << srcInfo.output_width << "x" << srcInfo.output_height
+      << ", placed as " << width << "x" << height);
+
+  Array<long> xMap(pageWidth);
+  Array<long> yMap(pageHeight);
+  map_to_page(xMap, pageWidth, width, srcInfo.output_width);
+  map_to_page(yMap, pageHeight, height, srcInfo.output_height);
+
+  size_t components = srcInfo.output_components;
+  Array<JSAMPLE> decoded(srcInfo.output_width * components);
+  JSAMPROW row = decoded;
+  long decodedLine = -1;
+  Error error;
+
+  for(size_t y = 0; y < pageHeight; y++)
+  {
+    if(yMap[y] < 0)
+    {
+      memset(pageLine, 0xff, pageWidth * colors);
+    }
+    else
+    {
+      while(decodedLine < yMap[y])
+      {
+        jpeg_read_scanlines(&srcInfo, &row, 1);
+        decodedLine++;
+      }
+      for(size_t x = 0; x < pageWidth; x++)
+      {
+        uint8_t* out = pageLine + (x * colors);
+        if(xMap[x] < 0)
+        {
+          memset(out, 0xff, colors);
+          continue;
+        }
+        const JSAMPLE* pixel = decoded + (xMap[x] * components);
+        if(cmyk)
+        {
+          uint8_t k = inverted ? pixel[3] : 255 - pixel[3];
+          uint8_t rgb[3];
+          for(size_t c = 0; c < 3; c++)
+          {
+            rgb[c] = ((inverted ? pixel[c] : 255 - pixel[c]) * k) / 255;
+          }
+          if(colors == 1)
+          {
+            out[0] = ((rgb[0] * 299) + (rgb[1] * 587) + (rgb[2] * 114)) / 1000;
+          }
+          else
+          {
+            memcpy(out, rgb, 3);
+          }
+        }
+        else
+        {
+          memcpy(out, pixel, colors);
+        }
+      }
+    }
+
+    encoder.add(converter.convert(pageLine));
+
+    // Hand over what has been encoded so far, to not hold the whole page
+    if(outBts.size() >= JPEG_CHUNK_SIZE)
+    {
+      if(!writeFun(std::move(outBts)))
+      {
+        error = Error("Write error");
+        break;
+      }
+      outBts = Bytestream();
+    }
+  }
+  encoder.flush();
+
+  // Lines cropped away at the bottom still need to be read for libjpeg to finish
+  while(!error && srcInfo.output_scanline < srcInfo.output_height)
+  {
+    jpeg_read_scanlines(&srcInfo, &row, 1);
+  }
+  if(!error)
+  {
+    jpeg_finish_decompress(&srcInfo);
+  }
+  jpeg_destroy_decompress(&srcInfo);
+  return error;
+}
+
+Error jpeg_to_raster(const std::string& inFileName, const PrintParameters& params,
+                     const WriteFun& writeFun, const ProgressFun& progressFun)
+{
+  if(!params.isRasterFormat())
+  {
+    return Error("JPEG can only be converted to PWG or URF");
+  }
+
+  // One page, but there may be copies and blank backsides
+  PageSequence pages = params.getPageSequence(1);
+  Bytestream outBts = params.format == PrintParameters::URF ? make_urf_file_hdr(pages.size())
+                                                            : make_pwg_file_hdr();
+  size_t outPageNo = 0;
+
+  InBinFile inFile(inFileName);
+  if(!inFile)
+  {
+    return Error("Failed to open input");
+  }
+  std::istream* in = &(*inFile);
+
+  // Each copy decodes the image again, so keep stdin around since it can't be rewound
+  std::istringstream buffered;
+  if(inFileName == "-" && std::count(pages.begin(), pages.end(), 1) > 1)
+  {
+    buffered.str(std::string(std::istreambuf_iterator<char>(*in), std::istreambuf_iterator<char>()));
+    in = &buffered;
+  }
+  bool rewind = false;
+
+  for(size_t page : pages)
+  {
+    outPageNo++;
+    make_raster_page_hdr(outBts, params, outPageNo);
+
+    Error error;
+    if(page == INVALID_PAGE)
+    {
+      error = raster_page(nullptr, params, outBts, writeFun);
+    }
+    else
+    {
+      if(rewind)
+      {
+        in->clear();
+        in->seekg(0);
+      }
+      error = raster_page(in, params, outBts, writeFun);
+      rewind = true;
+    }
+    if(error)
+    {
+      return error;
+    }
+
+    if(!writeFun(std::move(outBts)))
+    {
+      return Error("Write error");
+    }
+    outBts = Bytestream();
+
+    progressFun(outPageNo, pages.size());
+  }
+
+  return Error();
+}
@@ -0,0 +1,15 @@
+#ifndef JPEG2RASTER_H
+#define JPEG2RASTER_H
+
+#include "error.h"
+#include "functions.h"
+#include "printparameters.h"
+
+#include <string>
+
+// Decodes one scanline at a time and encodes straight into PWG or URF,
+// so only a few lines of the image are held at once
+Error jpeg_to_raster(const std::string& inFileName, const PrintParameters& params,
+                     const WriteFun& writeFun, const ProgressFun& progressFun = noOpProgressfun);
+
+#endif //JPEG2RASTER_H
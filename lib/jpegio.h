@@ -0,0 +1,156 @@
+#ifndef JPEGIO_H
+#define JPEGIO_H
+
+#include "array.h"
+#include "bytestream.h"
+#include "functions.h"
+#include "madness.h"
+
+#include <cstdio>
+#include <istream>
+
+#include <jpeglib.h>
+
+// libjpeg source and destination managers shared by the JPEG converters
+
+constexpr size_t JPEG_CHUNK_SIZE = 64 * 1024;
+
+struct base_source_mgr: jpeg_source_mgr
+{
+  base_source_mgr()
+  {
+    #if MADNESS
+    LIB(jpeg, "libjpeg.so.62");
+    FUNC(jpeg, boolean, jpeg_resync_to_restart, j_decompress_ptr, int);
+    #endif
+
+    jpeg_source_mgr::init_source = init_source;
+    jpeg_source_mgr::resync_to_restart = jpeg_resync_to_restart;
+    jpeg_source_mgr::term_source = term_source;
+  }
+
+  static void init_source(j_decompress_ptr) {}
+  static void term_source(j_decompress_ptr) {}
+};
+
+struct bts_source_mgr: base_source_mgr
+{
+  bts_source_mgr(Bytestream& in) : bts(in)
+  {
+    jpeg_source_mgr::fill_input_buffer = fill_input_buffer;
+    jpeg_source_mgr::skip_input_data = skip_input_data;
+    jpeg_source_mgr::bytes_in_buffer = bts.size();
+    jpeg_source_mgr::next_input_byte = bts.raw();
+  }
+
+  static boolean fill_input_buffer(j_decompress_ptr)
+  {
+    return TRUE;
+  }
+
+  static void skip_input_data(j_decompress_ptr cinfo, long numBytes)
+  {
+    bts_source_mgr* src = static_cast<bts_source_mgr*>(cinfo->src);
+    src->next_input_byte += static_cast<size_t>(numBytes);
+    src->bytes_in_buffer -= static_cast<size_t>(numBytes);
+  }
+
+  Bytestream& bts;
+};
+
+struct stream_source_mgr: base_source_mgr
+{
+  stream_source_mgr(std::istream& in) : in(in)
+  {
+    jpeg_source_mgr::fill_input_buffer = fill_input_buffer;
+    jpeg_source_mgr::skip_input_data = skip_input_data;
+    jpeg_source_mgr::bytes_in_buffer = 0;
+    jpeg_source_mgr::next_input_byte = nullptr;
+  }
+
+  static boolean fill_input_buffer(j_decompress_ptr cinfo)
+  {
+    stream_source_mgr* src = static_cast<stream_source_mgr*>(cinfo->src);
+    JOCTET* buffer = src->buffer;
+    src->in.read(reinterpret_cast<char*>(buffer), JPEG_CHUNK_SIZE);
+    size_t size = src->in.gcount();
+    if(size == 0)
+    {
+      // Truncated input, end it like libjpeg's own source managers do
+      buffer[0] = 0xFF;
+      buffer[1] = JPEG_EOI;
+      size = 2;
+    }
+    src->next_input_byte = buffer;
+    src->bytes_in_buffer = size;
+    return TRUE;
+  }
+
+  static void skip_input_data(j_decompress_ptr cinfo, long numBytes)
+  {
+    stream_source_mgr* src = static_cast<stream_source_mgr*>(cinfo->src);
+    if(numBytes <= 0)
+    {
+      return;
+    }
+    while(static_cast<size_t>(numBytes) > src->bytes_in_buffer)
+    {
+      numBytes -= static_cast<long>(src->bytes_in_buffer);
+      fill_input_buffer(cinfo);
+    }
+    src->next_input_byte += static_cast<size_t>(numBytes);
+    src->bytes_in_buffer -= static_cast<size_t>(numBytes);
+  }
+
+  Array<JOCTET> buffer = Array<JOCTET>(JPEG_CHUNK_SIZE);
+  std::istream& in;
+};
+
+// Hands the output to writeFun one full buffer at a time
+struct write_fun_destination_mgr: jpeg_destination_mgr
+{
+  write_fun_destination_mgr(const WriteFun& writeFun, size_t bufferSize)
+  : writeFun(writeFun), bufferSize(bufferSize), buffer(bufferSize)
+  {
+    jpeg_destination_mgr::init_destination = init_destination;
+    jpeg_destination_mgr::empty_output_buffer = empty_output_buffer;
+    jpeg_destination_mgr::term_destination = term_destination;
+    jpeg_destination_mgr::next_output_byte = buffer;
+    jpeg_destination_mgr::free_in_buffer = bufferSize;
+  }
+
+  static void init_destination(j_compress_ptr) {}
+
+  static boolean empty_output_buffer(j_compress_ptr cinfo)
+  {
+    write_fun_destination_mgr* dest = static_cast<write_fun_destination_mgr*>(cinfo->dest);
+    dest->forward(dest->bufferSize);
+
+    dest->next_output_byte = dest->buffer;
+    dest->free_in_buffer = dest->bufferSize;
+    return TRUE;
+  }
+
+  static void term_destination(j_compress_ptr cinfo)
+  {
+    write_fun_destination_mgr* dest = static_cast<write_fun_destination_mgr*>(cinfo->dest);
+    dest->forward(dest->bufferSize - dest->free_in_buffer);
+  }
+
+  // libjpeg can't be told to stop, so after a failed write the rest is dropped
+  void forward(size_t size)
+  {
+    if(!failed && size != 0)
+    {
+      const JOCTET* data = buffer;
+      failed = !writeFun(Bytestream(data, size));
+    }
+  }
+
+  const WriteFun& writeFun;
+  size_t bufferSize;
+  Array<JOCTET> buffer;
+  bool failed = false;
+};
+
+#endif //JPEGIO_H
@@ -0,0 +1,170 @@
+#include "paralleldeflate.h"
+
+#include <algorithm>
+#include <thread>
+
+// Room for the block headers and the empty stored block a sync flush ends with
+static constexpr size_t FLUSH_MARGIN = 64;
+
+static size_t thread_count(size_t threads)
+{
+  return threads != 0 ? threads : std::max(std::thread::hardware_concurrency(), 1U);
+}
+
+ParallelDeflate::ParallelDeflate(Format format, size_t threads, int level, int strategy,
+                                 size_t blockSize)
+  : _format(format), _level(level), _strategy(strategy),
+    _blockSize(blockSize != 0 ? blockSize : DefaultBlockSize),
+    _jobs(thread_count(threads) * 2)
+{
+  for(size_t i = 0; i < thread_count(threads); i++)
+  {
+    _workers.emplace_back();
+    _workers.back().run([this](){work();});
+  }
+}
+
+ParallelDeflate::~ParallelDeflate()
+{
+  _jobs.close();
+  for(LThread& worker : _workers)
+  {
+    worker.await();
+  }
+}
+
+List<std::future<ParallelDeflate::Block>> ParallelDeflate::compress(Bytestream&& data)
+{
+  List<std::future<Block>> blocks;
+  size_t offset = 0;
+  if(_pending.size() != 0)
+  {
+    offset = std::min(_blockSize - _pending.size(), data.size());
+    _pending.putBytes(data.raw(), offset);
+    if(_pending.size() < _blockSize)
+    {
+      return blocks;
+    }
+    blocks = flush();
+  }
+
+  // Full blocks are compressed straight from the written data
+  std::shared_ptr<Bytestream> input = std::make_shared<Bytestream>(std::move(data));
+  for(; input->size() - offset >= _blockSize; offset += _blockSize)
+  {
+    queue(input, offset, _blockSize, blocks);
+  }
+  _pending.putBytes(input->raw() + offset, input->size() - offset);
+  return blocks;
+}
+
+List<std::future<ParallelDeflate::Block>> ParallelDeflate::flush()
+{
+  List<std::future<Block>> blocks;
+  if(_pending.size() != 0)
+  {
+    size_t size = _pending.size();
+    queue(std::make_shared<Bytestream>(std::move(_pending)), 0, size, blocks);
+    _pending = Bytestream();
+  }
+  return blocks;
+}
+
+Bytestream ParallelDeflate::join(Block&& block)
+{
+  _crc = crc32_combine(_crc, block.crc, block.size);
+  _size += block.size;
+  if(_started)
+  {
+    return std::move(block.data);
+  }
+  _started = true;
+  Bytestream out = header();
+  out.putBytes(block.data.raw(), block.data.size());
+  return out;
+}
+
+Bytestream ParallelDeflate::finish()
+{
+  Bytestream out;
+  if(!_started)
+  {
+    out = header();
+    _started = true;
+  }
+  // An empty final block with fixed Huffman codes
+  out << (uint8_t)0x03 << (uint8_t)0x00;
+  if(_format == Gzip)
+  {
+    // CRC-32 and size modulo 2^32, little-endian
+    for(uint32_t value : {uint32_t(_crc), uint32_t(_size)})
+    {
+      for(int shift = 0; shift < 32; shift += 8)
+      {
+        out << (uint8_t)(value >> shift);
+      }
+    }
+  }
+  return out;
+}
+
+void ParallelDeflate::queue(const std::shared_ptr<Bytestream>& input, size_t offset, size_t size,
+                            List<std::future<Block>>& blocks)
+{
+  Job job {input, offset, size, {}};
+  blocks.push_back(job.result.get_future());
+  _jobs.push(std::move(job));
+}
+
+void ParallelDeflate::work()
+{
+  z_stream strm {};
+  deflateInit2(&strm, _level, Z_DEFLATED, -WindowBits, MemLevel, _strategy);
+  Bytestream buf(size_t(deflateBound(&strm, _blockSize) + FLUSH_MARGIN));
+
+  while(std::optional<Job> job = _jobs.pop())
+  {
+    try
+    {
+      Block block;
+      Bytef* in = job->input->raw() + job->offset;
+      strm.next_in = in;
+      strm.avail_in = job->size;
+      // Ending on a sync flush rather than finishing keeps the block non-final and
+      // byte-aligned, so the next one can follow right after it
+      do
+      {
+        strm.next_out = buf.raw();
+        strm.avail_out = buf.size();
+        deflate(&strm, Z_SYNC_FLUSH);
+        block.data.putBytes(buf.raw(), buf.size() - strm.avail_out);
+      } while(strm.avail_out == 0);
+      deflateReset(&strm);
+
+      if(_format == Gzip)
+      {
+        block.crc = crc32(0, in, job->size);
+      }
+      block.size = job->size;
+      job->input.reset();
+      job->result.set_value(std::move(block));
+    }
+    catch(...)
+    {
+      job->result.set_exception(std::current_exception());
+    }
+  }
+  deflateEnd(&strm);
+}
+
+Bytestream ParallelDeflate::header() const
+{
+  Bytestream out;
+  if(_format == Gzip)
+  {
+    // No name or timestamp, OS is Unix
+    out << (uint8_t)0x1f << (uint8_t)0x8b << (uint8_t)Z_DEFLATED << (uint8_t)0
+        << (uint32_t)0 << (uint8_t)0 << (uint8_t)3;
+  }
+  return out;
+}
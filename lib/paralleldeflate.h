@@ -0,0 +1,85 @@
+#ifndef PARALLELDEFLATE_H
+#define PARALLELDEFLATE_H
+
+#include "boundedqueue.h"
+#include "bytestream.h"
+#include "list.h"
+#include "lthread.h"
+
+#include <zlib.h>
+#include <future>
+#include <memory>
+
+// Compresses pigz-style: input is cut into blocks that are deflated on worker threads,
+// each on its own and ending on a byte boundary. Joined in order and closed with
+// finish(), the blocks make up one gzip or raw deflate stream.
+class ParallelDeflate
+{
+public:
+  enum Format
+  {
+    Raw,
+    Gzip
+  };
+
+  static constexpr size_t DefaultBlockSize = 128 * 1024;
+  // Kept small, as the printer needs as much memory to inflate
+  static constexpr int WindowBits = 11;
+  static constexpr int MemLevel = 7;
+
+  struct Block
+  {
+    Bytestream data;
+    uLong crc = 0;
+    size_t size = 0;
+  };
+
+  ParallelDeflate() = delete;
+  ParallelDeflate(const ParallelDeflate&) = delete;
+  ParallelDeflate& operator=(const ParallelDeflate&) = delete;
+
+  // Zero threads means one per core
+  ParallelDeflate(Format format, size_t threads = 0, int level = Z_DEFAULT_COMPRESSION,
+                  int strategy = Z_DEFAULT_STRATEGY, size_t blockSize = DefaultBlockSize);
+  ~ParallelDeflate();
+
+  // Queues the full blocks of data for compression, blocking while the workers are behind.
+  // What is left over is held back for the next call, or until flush().
+  List<std::future<Block>> compress(Bytestream&& data);
+  List<std::future<Block>> flush();
+
+  // For the consumer only: the bytes to send for the next block in order,
+  // and the stream end (with the gzip trailer) once all blocks are joined
+  Bytestream join(Block&& block);
+  Bytestream finish();
+
+private:
+  struct Job
+  {
+    std::shared_ptr<Bytestream> input;
+    size_t offset;
+    size_t size;
+    std::promise<Block> result;
+  };
+
+  void queue(const std::shared_ptr<Bytestream>& input, size_t offset, size_t size,
+             List<std::future<Block>>& blocks);
+  void work();
+  Bytestream header() const;
+
+  Format _format;
+  int _level;
+  int _strategy;
+  size_t _blockSize;
+
+  BoundedQueue<Job> _jobs;
+  List<LThread> _workers;
+
+  Bytestream _pending;
+
+  bool _started = false;
+  uLong _crc = 0;
+  size_t _size = 0;
+};
+
+#endif // PARALLELDEFLATE_H
@@ -12,8 +12,6 @@
 void make_pwg_hdr(Bytestream& outBts, const PrintParameters& params, bool backside);
 void make_urf_hdr(Bytestream& outBts, const PrintParameters& params);
 
-void compress_line(uint8_t* raw, size_t len, Bytestream& outBts, size_t oneChunk);
-
 Bytestream make_pwg_file_hdr()
 {
   Bytestream pwgFileHdr;
@@ -36,24 +34,19 @@ inline uint8_t reverse_byte(uint8_t b)
 
 void bmp_to_pwg(Bytestream& bmpBts, Bytestream& outBts, size_t page, const PrintParameters& params)
 {
-  bool backside = params.isTwoSided() && ((page % 2) == 0);
+  bmp_to_pwg(bmpBts.raw(), outBts, page, params);
+}
 
-  DBG(<< "Page " << page);
+void bmp_to_pwg(const uint8_t* bmp, Bytestream& outBts, size_t page, const PrintParameters& params)
+{
+  bool backside = params.isTwoSided() && ((page % 2) == 0);
 
-  if(!(params.format == PrintParameters::URF))
-  {
-    make_pwg_hdr(outBts, params, backside);
-  }
-  else
-  {
-    make_urf_hdr(outBts, params);
-  }
+  make_raster_page_hdr(outBts, params, page);
 
   size_t yRes = params.getPaperSizeHInPixels();
-  uint8_t* raw = bmpBts.raw();
   size_t bytesPerLine = params.getPaperSizeWInBytes();
   int oneLine = backside && params.getBackVFlip() ? -bytesPerLine : bytesPerLine;
-  uint8_t* row0 = backside && params.getBackVFlip() ? raw + ((yRes - 1) * bytesPerLine) : raw;
+  const uint8_t* row0 = backside && params.getBackVFlip() ? bmp + ((yRes - 1) * bytesPerLine) : bmp;
   Array<uint8_t> tmpLine(bytesPerLine);
 
   size_t colors = params.getNumberOfColors();
@@ -65,10 +58,10 @@ void bmp_to_pwg(Bytestream& bmpBts, Bytestream& outBts, size_t page, const Print
 
   for(size_t y = 0; y < yRes; y++)
   {
-    uint8_t* thisLine = row0 + (y * oneLine);
+    const uint8_t* thisLine = row0 + (y * oneLine);
     uint8_t lineRepeat = 0;
 
-    uint8_t* next_line = thisLine + oneLine;
+    const uint8_t* next_line = thisLine + oneLine;
     while((y+1)<yRes && memcmp(thisLine, next_line, bytesPerLine) == 0)
     {
       y++;
@@ -93,7 +86,7 @@ void bmp_to_pwg(Bytestream& bmpBts, Bytestream& outBts, size_t page, const Print
       }
       else
       {
-        uint8_t* lastChunk = thisLine + bytesPerLine - oneChunk;
+        const uint8_t* lastChunk = thisLine + bytesPerLine - oneChunk;
         for(size_t i = 0; i < bytesPerLine; i += oneChunk)
         {
           memcpy(tmpLine+i, lastChunk-i, oneChunk);
@@ -108,15 +101,31 @@ void bmp_to_pwg(Bytestream& bmpBts, Bytestream& outBts, size_t page, const Print
   }
 }
 
-void compress_line(uint8_t* raw, size_t len, Bytestream& outBts, size_t oneChunk)
+void make_raster_page_hdr(Bytestream& outBts, const PrintParameters& params, size_t page)
+{
+  bool backside = params.isTwoSided() && ((page % 2) == 0);
+
+  DBG(<< "Page " << page);
+
+  if(!(params.format == PrintParameters::URF))
+  {
+    make_pwg_hdr(outBts, params, backside);
+  }
+  else
+  {
+    make_urf_hdr(outBts, params);
+  }
+}
+
+void compress_line(const uint8_t* raw, size_t len, Bytestream& outBts, size_t oneChunk)
 {
-  uint8_t* current;
-  uint8_t* pos = raw;
-  uint8_t* epos = raw + len;
+  const uint8_t* current;
+  const uint8_t* pos = raw;
+  const uint8_t* epos = raw + len;
 
   while(pos != epos)
   {
-    uint8_t* currentStart = pos;
+    const uint8_t* currentStart = pos;
     current = pos;
     pos += oneChunk;
 
@@ -179,6 +188,33 @@ void compress_line(uint8_t* raw, size_t len, Bytestream& outBts, size_t oneChunk
   }
 }
 
+LineRepeatEncoder::LineRepeatEncoder(Bytestream& outBts, size_t byteWidth, size_t oneChunk)
+  : _outBts(outBts), _byteWidth(byteWidth), _oneChunk(oneChunk), _prevLine(byteWidth)
+{}
+
+void LineRepeatEncoder::add(const uint8_t* line)
+{
+  if(_pending && _lineRepeat < 255 && memcmp(line, _prevLine, _byteWidth) == 0)
+  {
+    _lineRepeat++;
+    return;
+  }
+  flush();
+  memcpy(_prevLine, line, _byteWidth);
+  _pending = true;
+}
+
+void LineRepeatEncoder::flush()
+{
+  if(_pending)
+  {
+    _outBts << _lineRepeat;
+    compress_line(_prevLine, _byteWidth, _outBts, _oneChunk);
+    _pending = false;
+    _lineRepeat = 0;
+  }
+}
+
 static const std::map<std::string, UrfPgHdr::MediaType_enum>
   UrfMediaTypeMappings {{"auto", UrfPgHdr::AutomaticMediaType},
                         {"stationery", UrfPgHdr::Stationery},
@@ -1,6 +1,7 @@
 #ifndef PPM2PWG_H
 #define PPM2PWG_H
 
+#include "array.h"
 #include "bytestream.h"
 #include "printparameters.h"
 
@@ -13,6 +14,37 @@ Bytestream make_urf_file_hdr(uint32_t pages);
 void bmp_to_pwg(Bytestream& bmpBts, Bytestream& outBts, size_t page,
                 const PrintParameters& params);
 
+// As above, but encoding straight from memory owned by someone else
+void bmp_to_pwg(const uint8_t* bmp, Bytestream& outBts, size_t page,
+                const PrintParameters& params);
+
+// Header for the given page of the output, backsides are transformed as per params
+void make_raster_page_hdr(Bytestream& outBts, const PrintParameters& params, size_t page);
+
+void compress_line(const uint8_t* raw, size_t len, Bytestream& outBts, size_t oneChunk);
+
+// Streaming counterpart of the line repeat detection in bmp_to_pwg
+class LineRepeatEncoder
+{
+public:
+  LineRepeatEncoder() = delete;
+  LineRepeatEncoder(const LineRepeatEncoder&) = delete;
+  LineRepeatEncoder& operator=(const LineRepeatEncoder&) = delete;
+
+  LineRepeatEncoder(Bytestream& outBts, size_t byteWidth, size_t oneChunk);
+
+  void add(const uint8_t* line);
+  void flush();
+
+private:
+  Bytestream& _outBts;
+  size_t _byteWidth;
+  size_t _oneChunk;
+  Array<uint8_t> _prevLine;
+  uint8_t _lineRepeat = 0;
+  bool _pending = false;
+};
+
 bool isUrfMediaType(const std::string& mediaType);
 
 #endif //PPM2PWG_H
@@ -121,6 +121,10 @@ public:
   ColorMode colorMode = sRGB24;
   Quality quality = DefaultQuality;
   bool antiAlias = false;
+  // Let JPEGs be reduced to what the paper size and resolution can show
+  bool downscaleJpeg = false;
+  // Drop JPEG thumbnails and metadata the printer has no use for
+  bool stripJpegMarkers = false;
   std::string paperSizeName = "iso_a4_210x297mm";
 
   uint32_t hwResW = 300;
@@ -1,64 +1,297 @@
 #include "pwg2ppm.h"
 
-#include <fstream>
+#include "array.h"
+#include "binfile.h"
 
-void invert(Bytestream& bts);
+#include <algorithm>
+#include <cstring>
+#include <limits>
 
-void cmyk2rgb(Bytestream& cmyk);
+void invert(uint8_t* raw, size_t size);
 
-void raster_to_bmp(Bytestream& outBts, Bytestream& file,
-                   size_t width, size_t height, size_t colors, size_t bits,
-                   bool urf)
+template <typename T>
+size_t cmyk2rgb(uint8_t* raw, size_t size);
+
+size_t raster_byte_width(size_t width, size_t colors, size_t bits)
 {
-  Bytestream grey8White {uint8_t{0}};
-  Bytestream RGBWhite {uint8_t{0xff}, uint8_t{0xff}, uint8_t{0xff}};
-  Bytestream CMYKWhite {uint8_t{0x00}, uint8_t{0x00}, uint8_t{0x00}, uint8_t{0x00}};
-  Bytestream white = (colors == 1 ? grey8White : colors == 4 ? CMYKWhite : RGBWhite);
-  size_t oneChunk = bits == 1 ? colors : colors * bits / 8;
-  size_t byteWidth = bits == 1 ? width / 8 : width * oneChunk;
+  // 1-bit lines are padded to whole bytes
+  return bits == 1 ? (width + 7) / 8 : width * colors * bits / 8;
+}
+
+size_t urf_colors(UrfPgHdr::ColorSpace_enum colorSpace)
+{
+  switch(colorSpace)
+  {
+    case UrfPgHdr::sGray:
+    case UrfPgHdr::Gray:
+      return 1;
+    case UrfPgHdr::sRGB:
+    case UrfPgHdr::CieLab:
+    case UrfPgHdr::AdobeRGB:
+    case UrfPgHdr::RGB:
+      return 3;
+    case UrfPgHdr::CMYK:
+      return 4;
+    default:
+      throw std::logic_error("Unhandled color mode");
+  }
+}
 
-  while(height)
+uint8_t decode_raster_line(uint8_t* line, Bytestream& file, size_t byteWidth, size_t oneChunk,
+                           uint8_t white, bool urf)
+{
+  uint8_t lineRepeat;
+  file >> lineRepeat;
+
+  size_t pos = 0;
+  while(pos != byteWidth)
   {
-    Bytestream line;
-    uint8_t lineRepeat;
-    file >> lineRepeat;
+    uint8_t count;
+    file >> count;
 
-    while(line.size() != byteWidth)
+    if(urf && count==128)
+    { // URF special case: 128 means fill line with white
+      memset(line + pos, white, byteWidth - pos);
+      pos = byteWidth;
+    }
+    else if(count < 128)
+    { // repeats
+      size_t repeats = count+1;
+      if(pos + (repeats * oneChunk) > byteWidth)
+      {
+        throw std::out_of_range("Raster line overflow");
+      }
+      file.getBytes(line + pos, oneChunk);
+      for(size_t i=1; i<repeats; i++)
+      {
+        memcpy(line + pos + (i * oneChunk), line + pos, oneChunk);
+      }
+      pos += repeats * oneChunk;
+    }
+    else
+    { // verbatim
+      size_t verbatim = (-1*(static_cast<int>(count)-257));
+      if(pos + (verbatim * oneChunk) > byteWidth)
+      {
+        throw std::out_of_range("Raster line overflow");
+      }
+      file.getBytes(line + pos, verbatim * oneChunk);
+      pos += verbatim * oneChunk;
+    }
+  }
+  return lineRepeat;
+}
+
+uint8_t skip_raster_line(Bytestream& file, size_t byteWidth, size_t oneChunk, bool urf)
+{
+  uint8_t lineRepeat;
+  file >> lineRepeat;
+
+  size_t pos = 0;
+  while(pos != byteWidth)
+  {
+    uint8_t count;
+    file >> count;
+
+    size_t chunks = 0;
+    size_t skip = 0;
+    if(urf && count==128)
+    {
+      pos = byteWidth;
+      continue;
+    }
+    else if(count < 128)
+    {
+      chunks = count+1;
+      skip = oneChunk;
+    }
+    else
     {
-      uint8_t count;
-      file >> count;
+      chunks = (-1*(static_cast<int>(count)-257));
+      skip = chunks * oneChunk;
+    }
+    if(pos + (chunks * oneChunk) > byteWidth || skip > file.remaining())
+    {
+      throw std::out_of_range("Raster line overflow");
+    }
+    file += skip;
+    pos += chunks * oneChunk;
+  }
+  return lineRepeat;
+}
+
+void skip_raster_page(Bytestream& file, size_t width, size_t height, size_t colors, size_t bits,
+                      bool urf)
+{
+  size_t oneChunk = bits == 1 ? colors : colors * bits / 8;
+  size_t byteWidth = raster_byte_width(width, colors, bits);
+  size_t y = 0;
 
-      if(urf && count==128)
-      { // URF special case: 128 means fill line with white
-        while(line.size() != byteWidth)
+  while(y < height)
+  {
+    y += skip_raster_line(file, byteWidth, oneChunk, urf) + 1;
+  }
+}
+
+inline size_t next_multiple(size_t value, size_t step)
+{
+  return ((value + step - 1) / step) * step;
+}
+
+// Like decode_raster_line, but only stores every step:th chunk
+uint8_t decode_sampled_line(uint8_t* line, Bytestream& file, size_t byteWidth, size_t oneChunk,
+                            size_t step, uint8_t white, bool urf)
+{
+  uint8_t lineRepeat;
+  file >> lineRepeat;
+
+  size_t chunks = byteWidth / oneChunk;
+  size_t chunk = 0;
+  while(chunk != chunks)
+  {
+    uint8_t count;
+    file >> count;
+
+    if(urf && count==128)
+    { // URF special case: 128 means fill line with white
+      size_t first = next_multiple(chunk, step);
+      if(first < chunks)
+      {
+        memset(line + ((first / step) * oneChunk), white, (((chunks - first - 1) / step) + 1) * oneChunk);
+      }
+      chunk = chunks;
+    }
+    else if(count < 128)
+    { // repeats
+      size_t repeats = count+1;
+      if(chunk + repeats > chunks || oneChunk > file.remaining())
+      {
+        throw std::out_of_range("Raster line overflow");
+      }
+      size_t first = next_multiple(chunk, step);
+      if(first < chunk + repeats)
+      {
+        uint8_t* firstOut = line + ((first / step) * oneChunk);
+        file.getBytes(firstOut, oneChunk);
+        for(size_t i = first + step; i < chunk + repeats; i += step)
         {
-          line << white;
+          memcpy(line + ((i / step) * oneChunk), firstOut, oneChunk);
         }
       }
-      else if(count < 128)
-      { // repeats
-        size_t repeats = count+1;
-        Bytestream tmp = file.getBytestream(oneChunk);
-        for(size_t i=0; i<repeats; i++)
+      else
+      {
+        file += oneChunk;
+      }
+      chunk += repeats;
+    }
+    else
+    { // verbatim
+      size_t verbatim = (-1*(static_cast<int>(count)-257));
+      if(chunk + verbatim > chunks || (verbatim * oneChunk) > file.remaining())
+      {
+        throw std::out_of_range("Raster line overflow");
+      }
+      size_t start = file.pos();
+      for(size_t i = next_multiple(chunk, step); i < chunk + verbatim; i += step)
+      {
+        file.setPos(start + ((i - chunk) * oneChunk));
+        file.getBytes(line + ((i / step) * oneChunk), oneChunk);
+      }
+      file.setPos(start + (verbatim * oneChunk));
+      chunk += verbatim;
+    }
+  }
+  return lineRepeat;
+}
+
+size_t thumbnail_dimension(size_t size, size_t step)
+{
+  return (size + step - 1) / step;
+}
+
+void raster_to_thumbnail(Bytestream& outBts, Bytestream& file,
+                         size_t width, size_t height, size_t colors, size_t bits,
+                         bool urf, size_t step)
+{
+  if(step == 0)
+  {
+    throw std::logic_error("Thumbnail step must be non-zero");
+  }
+
+  uint8_t white = colors == 3 ? 0xff : 0x00;
+  size_t oneChunk = bits == 1 ? colors : colors * bits / 8;
+  size_t byteWidth = raster_byte_width(width, colors, bits);
+  size_t outWidth = thumbnail_dimension(width, step);
+  size_t outByteWidth = raster_byte_width(outWidth, colors, bits);
+
+  outBts = Bytestream(thumbnail_dimension(height, step) * outByteWidth);
+  uint8_t* raw = outBts.raw();
+
+  // 1-bit lines are short, decode them whole and pick out the bits
+  Array<uint8_t> bitLine(bits == 1 ? byteWidth : 0);
+
+  size_t y = 0;
+  while(y < height)
+  {
+    size_t groupEnd = std::min(height, y + file.peek<uint8_t>() + 1);
+    size_t first = next_multiple(y, step);
+
+    if(first >= groupEnd)
+    { // No output line in this group, don't bother decoding it
+      skip_raster_line(file, byteWidth, oneChunk, urf);
+    }
+    else
+    {
+      uint8_t* line = raw + ((first / step) * outByteWidth);
+      if(bits == 1)
+      {
+        decode_raster_line(bitLine, file, byteWidth, oneChunk, white, urf);
+        memset(line, 0, outByteWidth);
+        for(size_t x = 0; x < outWidth; x++)
         {
-          line << tmp;
+          size_t inX = x * step;
+          if(bitLine[inX / 8] & (0x80 >> (inX % 8)))
+          {
+            line[x / 8] |= (0x80 >> (x % 8));
+          }
         }
       }
       else
-      { // verbatim
-        size_t verbatim = (-1*(static_cast<int>(count)-257));
-        Bytestream tmp = file.getBytestream(verbatim*oneChunk);
-        line << tmp;
+      {
+        decode_sampled_line(line, file, byteWidth, oneChunk, step, white, urf);
+      }
+
+      for(size_t i = first + step; i < groupEnd; i += step)
+      {
+        memcpy(raw + ((i / step) * outByteWidth), line, outByteWidth);
       }
     }
+    y = groupEnd;
+  }
+}
 
-    outBts << line;
-    height--;
-    for(size_t i=0; i < lineRepeat; i++)
+void raster_to_bmp(Bytestream& outBts, Bytestream& file,
+                   size_t width, size_t height, size_t colors, size_t bits,
+                   bool urf)
+{
+  uint8_t white = colors == 3 ? 0xff : 0x00;
+  size_t oneChunk = bits == 1 ? colors : colors * bits / 8;
+  size_t byteWidth = raster_byte_width(width, colors, bits);
+
+  outBts = Bytestream(height * byteWidth);
+  uint8_t* raw = outBts.raw();
+  size_t y = 0;
+
+  while(y < height)
+  {
+    uint8_t* line = raw + (y * byteWidth);
+    uint8_t lineRepeat = decode_raster_line(line, file, byteWidth, oneChunk, white, urf);
+    y++;
+
+    for(size_t i=0; i < lineRepeat && y < height; i++, y++)
     {
-      outBts << line;
+      memcpy(raw + (y * byteWidth), line, byteWidth);
     }
-    height-=lineRepeat;
   }
 }
 
@@ -66,54 +299,103 @@ void write_ppm(Bytestream& outBts, size_t width, size_t height,
                size_t colors, size_t bits, bool black,
                const std::string& outfilePrefix, int page)
 {
-  if((bits == 1 && !black) || (bits == 8 && black))
+  // Conversions are done in place, CMYK->RGB just leaves a shorter result
+  size_t size = outBts.size();
+  if((bits == 1 && !black) || (bits != 1 && black))
   {
-    invert(outBts);
+    invert(outBts.raw(), size);
   }
   else if(colors == 4)
   {
-    cmyk2rgb(outBts);
+    size = bits == 16 ? cmyk2rgb<uint16_t>(outBts.raw(), size)
+                      : cmyk2rgb<uint8_t>(outBts.raw(), size);
   }
-  std::string outFileSuffix = (colors > 2 ? ".ppm" : bits == 8 ? ".pgm" : ".pbm");
+  std::string outFileSuffix = (colors > 2 ? ".ppm" : bits == 1 ? ".pbm" : ".pgm");
   std::string outFileName = outfilePrefix+std::to_string(page) + outFileSuffix;
-  std::ofstream outFile(outFileName, std::ofstream::out);
-  outFile << (colors > 2 ? "P6" : (bits == 8 ? "P5" : "P4"))
-          << '\n' << width << ' ' << height << '\n';
+  std::string header = std::string(colors > 2 ? "P6" : (bits == 1 ? "P4" : "P5"))
+                     + '\n' + std::to_string(width) + ' ' + std::to_string(height) + '\n';
   if(bits == 8)
   {
-    outFile << 255 << '\n';
+    header += "255\n";
   }
   else if(bits == 16)
   {
-    outFile << 65535 << '\n';
+    header += "65535\n";
   }
 
-  outFile << outBts;
+  // The header is buffered and goes out together with the page in one writev
+  BufferedOutFile outFile(outFileName, header.size());
+  if(!outFile.write(header) || !outFile.write(outBts.raw(), size) || !outFile.flush())
+  {
+    throw std::runtime_error("Failed to write " + outFileName);
+  }
 }
 
-void invert(Bytestream& bts)
+void invert(uint8_t* raw, size_t size)
 {
-  size_t size = bts.size();
-  uint8_t* raw = bts.raw();
-  for(size_t i=0; i < size; i++)
+  size_t i = 0;
+  // A word at a time, which the compiler widens further where it can
+  for(; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+  {
+    uint64_t word;
+    memcpy(&word, raw + i, sizeof(word));
+    word = ~word;
+    memcpy(raw + i, &word, sizeof(word));
+  }
+  for(; i < size; i++)
   {
     raw[i] = ~raw[i];
   }
 }
 
-void cmyk2rgb(Bytestream& cmyk)
+template <typename T>
+inline T get_be(const uint8_t* raw)
+{
+  T value = 0;
+  for(size_t i = 0; i < sizeof(T); i++)
+  {
+    value = (value << 8) | raw[i];
+  }
+  return value;
+}
+
+template <typename T>
+inline void put_be(uint8_t* raw, T value)
 {
-  Bytestream rgb((cmyk.size() * 3) / 4);
-  uint8_t* _cmyk = cmyk.raw();
-  uint8_t* _rgb = rgb.raw();
-  size_t size = cmyk.size();
+  for(size_t i = sizeof(T); i > 0; i--)
+  {
+    raw[i - 1] = value & 0xff;
+    value >>= 8;
+  }
+}
 
-  for(size_t i=0, j=0; i < size; i+=4, j+=3)
+template <typename T>
+inline T subtract_ink(T kInv, T ink)
+{
+  return ink > kInv ? 0 : kInv - ink;
+}
+
+template <typename T>
+size_t cmyk2rgb(uint8_t* raw, size_t size)
+{
+  // Each RGB pixel ends up at or before the CMYK pixel it came from,
+  // so reading all of a pixel before writing makes this safe in place.
+  const size_t inPixel = 4 * sizeof(T);
+  const size_t outPixel = 3 * sizeof(T);
+  size_t pixels = size / inPixel;
+
+  for(size_t p = 0; p < pixels; p++)
   {
-    uint8_t kInv = 255 - _cmyk[i+3];
-    _rgb[j] = kInv - _cmyk[i];
-    _rgb[j+1] = kInv - _cmyk[i+1];
-    _rgb[j+2] = kInv - _cmyk[i+2];
+    const uint8_t* in = raw + (p * inPixel);
+    T c = get_be<T>(in);
+    T m = get_be<T>(in + sizeof(T));
+    T y = get_be<T>(in + (2 * sizeof(T)));
+    T kInv = std::numeric_limits<T>::max() - get_be<T>(in + (3 * sizeof(T)));
+
+    uint8_t* out = raw + (p * outPixel);
+    put_be<T>(out, subtract_ink(kInv, c));
+    put_be<T>(out + sizeof(T), subtract_ink(kInv, m));
+    put_be<T>(out + (2 * sizeof(T)), subtract_ink(kInv, y));
   }
-  cmyk = rgb;
+  return pixels * outPixel;
 }
@@ -2,6 +2,26 @@
 #define PWG2PPM_H
 
 #include "bytestream.h"
+#include "urfpghdr.h"
+
+size_t raster_byte_width(size_t width, size_t colors, size_t bits);
+
+size_t urf_colors(UrfPgHdr::ColorSpace_enum colorSpace);
+
+uint8_t decode_raster_line(uint8_t* line, Bytestream& file, size_t byteWidth, size_t oneChunk,
+                           uint8_t white, bool urf);
+
+// Advance past one page of encoded raster data without decoding it
+void skip_raster_page(Bytestream& file, size_t width, size_t height, size_t colors, size_t bits,
+                      bool urf);
+
+// Size of a thumbnail dimension when keeping every step:th line or pixel
+size_t thumbnail_dimension(size_t size, size_t step);
+
+// Decode a page keeping only every step:th line and pixel, skipping the rest
+void raster_to_thumbnail(Bytestream& outBts, Bytestream& file,
+                         size_t width, size_t height, size_t colors, size_t bits,
+                         bool urf, size_t step);
 
 void raster_to_bmp(Bytestream& outBts, Bytestream& file,
                    size_t width, size_t height, size_t colors, size_t bits,
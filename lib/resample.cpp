@@ -0,0 +1,364 @@
+#include "resample.h"
+
+#include "ppm2pwg.h"
+#include "pwg2ppm.h"
+#include "pwgpghdr.h"
+#include "urfpghdr.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+inline size_t checked_factor(size_t factor)
+{
+  if(factor == 0)
+  {
+    throw std::logic_error("Resampling factor must be non-zero");
+  }
+  return factor;
+}
+
+LineResampler::LineResampler(size_t width, size_t colors, size_t bits,
+                             size_t xFactor, size_t yFactor, Mode mode)
+  : _colors(colors), _bits(bits),
+    _xFactor(checked_factor(xFactor)), _yFactor(checked_factor(yFactor)), _mode(mode),
+    _outWidth(width / _xFactor), _outByteWidth(raster_byte_width(_outWidth, colors, bits)),
+    _sums(_outWidth * colors), _outLine(_outByteWidth)
+{
+  if(bits == 1 && colors != 1)
+  {
+    throw std::logic_error("1-bit resampling only supported for one color");
+  }
+  memset(_sums, 0, _outWidth * _colors * sizeof(uint32_t));
+}
+
+bool LineResampler::addLine(const uint8_t* inLine)
+{
+  size_t linePos = _lineNo % _yFactor;
+  _lineNo++;
+
+  // Decimation only looks at the first line of each group
+  if(_mode == BoxFilter || linePos == 0)
+  {
+    accumulate(inLine);
+  }
+  if(linePos == _yFactor - 1)
+  {
+    emit();
+    return true;
+  }
+  return false;
+}
+
+uint32_t LineResampler::sampleAt(const uint8_t* inLine, size_t i) const
+{
+  switch(_bits)
+  {
+    case 1:
+      return (inLine[i / 8] >> (7 - (i % 8))) & 1;
+    case 16:
+      return (inLine[i * 2] << 8) | inLine[(i * 2) + 1];
+    default:
+      return inLine[i];
+  }
+}
+
+void LineResampler::accumulate(const uint8_t* inLine)
+{
+  size_t xSamples = _mode == Decimate ? 1 : _xFactor;
+  for(size_t x = 0; x < _outWidth; x++)
+  {
+    uint32_t* sums = _sums + (x * _colors);
+    for(size_t k = 0; k < xSamples; k++)
+    {
+      size_t inPos = ((x * _xFactor) + k) * _colors;
+      for(size_t c = 0; c < _colors; c++)
+      {
+        sums[c] += sampleAt(inLine, inPos + c);
+      }
+    }
+  }
+}
+
+void LineResampler::emit()
+{
+  uint32_t samples = _mode == Decimate ? 1 : _xFactor * _yFactor;
+  size_t size = _outWidth * _colors;
+
+  if(_bits == 1)
+  {
+    memset(_outLine, 0, _outByteWidth);
+  }
+
+  for(size_t i = 0; i < size; i++)
+  {
+    // Rounded average, for 1-bit this becomes a majority vote
+    uint32_t value = (_sums[i] + (samples / 2)) / samples;
+    switch(_bits)
+    {
+      case 1:
+        if(value != 0)
+        {
+          _outLine[i / 8] |= (0x80 >> (i % 8));
+        }
+        break;
+      case 16:
+        _outLine[i * 2] = value >> 8;
+        _outLine[(i * 2) + 1] = value & 0xff;
+        break;
+      default:
+        _outLine[i] = value;
+        break;
+    }
+    _sums[i] = 0;
+  }
+}
+
+// More than any file or page header
+#define MAX_HEADER_SIZE 4096
+#define STREAM_CHUNK_SIZE (64 * 1024)
+
+// Raster input either all in memory, or read from a stream as it is needed
+class RasterSource
+{
+public:
+  RasterSource(Bytestream& bts) : _bts(bts)
+  {}
+  RasterSource(std::istream& in) : _in(&in), _bts(_window)
+  {}
+
+  // With at least the next bytes in it, or as many as there are left
+  Bytestream& need(size_t bytes)
+  {
+    if(_in != nullptr && _bts.remaining() < bytes && *_in)
+    {
+      Bytestream window(_bts.raw() + _bts.pos(), _bts.remaining());
+      window << Bytestream(*_in, std::max<size_t>(bytes, STREAM_CHUNK_SIZE) - window.size());
+      _window = std::move(window);
+    }
+    return _bts;
+  }
+
+  bool atEnd()
+  {
+    return need(1).remaining() == 0;
+  }
+
+private:
+  std::istream* _in = nullptr;
+  Bytestream _window;
+  Bytestream& _bts;
+};
+
+void resample_page(RasterSource& in, Bytestream& outBts,
+                   size_t width, size_t height, size_t colors, size_t bits,
+                   size_t xFactor, size_t yFactor, LineResampler::Mode mode, bool urf)
+{
+  uint8_t white = colors == 3 ? 0xff : 0x00;
+  size_t oneChunk = bits == 1 ? colors : colors * bits / 8;
+  size_t byteWidth = raster_byte_width(width, colors, bits);
+  // Line repeat, plus a count for every chunk at worst
+  size_t maxLineSize = 1 + byteWidth + (byteWidth / oneChunk) + 1;
+
+  LineResampler resampler(width, colors, bits, xFactor, yFactor, mode);
+  LineRepeatEncoder encoder(outBts, resampler.outByteWidth(), oneChunk);
+  Array<uint8_t> line(byteWidth);
+
+  size_t y = 0;
+  while(y < height)
+  {
+    Bytestream& inBts = in.need(maxLineSize);
+    uint8_t lineRepeat = decode_raster_line(line, inBts, byteWidth, oneChunk, white, urf);
+    for(size_t i = 0; i <= lineRepeat && y < height; i++, y++)
+    {
+      if(resampler.addLine(line))
+      {
+        encoder.add(resampler.line());
+      }
+    }
+  }
+  encoder.flush();
+}
+
+void downsample_bitmap(Bytestream& outBts, const uint8_t* bmp,
+                       size_t width, size_t height, size_t colors, size_t bits,
+                       size_t xFactor, size_t yFactor, LineResampler::Mode mode)
+{
+  LineResampler resampler(width, colors, bits, xFactor, yFactor, mode);
+  size_t byteWidth = raster_byte_width(width, colors, bits);
+  size_t outByteWidth = resampler.outByteWidth();
+
+  outBts = Bytestream((height / yFactor) * outByteWidth);
+  uint8_t* out = outBts.raw();
+
+  for(size_t y = 0; y < height; y++)
+  {
+    if(resampler.addLine(bmp + (y * byteWidth)))
+    {
+      memcpy(out, resampler.line(), outByteWidth);
+      out += outByteWidth;
+    }
+  }
+}
+
+bool downsample_factor(uint32_t fromRes, uint32_t toRes, size_t& factor)
+{
+  if(toRes == 0 || fromRes < toRes || (fromRes % toRes) != 0)
+  {
+    return false;
+  }
+  factor = fromRes / toRes;
+  return true;
+}
+
+bool raster_resolution(Bytestream& inBts, uint32_t& resX, uint32_t& resY)
+{
+  size_t pos = inBts.pos();
+  bool found = false;
+  try
+  {
+    if(inBts >>= "RaS2")
+    {
+      PwgPgHdr pwgHdr;
+      pwgHdr.decodeFrom(inBts);
+      resX = pwgHdr.HWResolutionX;
+      resY = pwgHdr.HWResolutionY;
+      found = true;
+    }
+    else if(inBts >>= "UNIRAST")
+    {
+      uint32_t pageCount;
+      inBts >> uint8_t{0} >> pageCount;
+      UrfPgHdr urfHdr;
+      urfHdr.decodeFrom(inBts);
+      resX = resY = urfHdr.HWRes;
+      found = true;
+    }
+  }
+  catch(const std::exception&)
+  {
+    found = false;
+  }
+  inBts.setPos(pos);
+  return found;
+}
+
+Error resample_raster(RasterSource& in, uint32_t resX, uint32_t resY,
+                      LineResampler::Mode mode, const WriteFun& writeFun,
+                      const ProgressFun& progressFun)
+{
+  Bytestream outBts;
+  bool urf = false;
+  uint32_t pageCount = 0;
+
+  // Always the same Bytestream, just with more read into it as needed
+  Bytestream& inBts = in.need(MAX_HEADER_SIZE);
+  if(inBts >>= "RaS2")
+  {
+    outBts = make_pwg_file_hdr();
+  }
+  else if(inBts >>= "UNIRAST")
+  {
+    if(resX != resY)
+    {
+      return Error("URF must have a symmetric resolution.");
+    }
+    inBts >> uint8_t{0} >> pageCount;
+    outBts = make_urf_file_hdr(pageCount);
+    urf = true;
+  }
+  else
+  {
+    return Error("Unknown raster format");
+  }
+
+  size_t page = 0;
+  while(!in.atEnd())
+  {
+    in.need(MAX_HEADER_SIZE);
+    page++;
+    size_t width = 0;
+    size_t height = 0;
+    size_t colors = 0;
+    size_t bits = 0;
+    size_t xFactor = 1;
+    size_t yFactor = 1;
+
+    if(urf)
+    {
+      UrfPgHdr urfHdr;
+      urfHdr.decodeFrom(inBts);
+      if(!downsample_factor(urfHdr.HWRes, resX, xFactor))
+      {
+        return Error("Can not downsample " + std::to_string(urfHdr.HWRes) + " to " +
+                     std::to_string(resX) + " DPI");
+      }
+      yFactor = xFactor;
+      width = urfHdr.Width;
+      height = urfHdr.Height;
+      colors = urf_colors(urfHdr.ColorSpace);
+      bits = urfHdr.BitsPerPixel / colors;
+
+      urfHdr.Width = width / xFactor;
+      urfHdr.Height = height / yFactor;
+      urfHdr.HWRes = resX;
+      urfHdr.encodeInto(outBts);
+    }
+    else
+    {
+      PwgPgHdr pwgHdr;
+      pwgHdr.decodeFrom(inBts);
+      if(!downsample_factor(pwgHdr.HWResolutionX, resX, xFactor) ||
+         !downsample_factor(pwgHdr.HWResolutionY, resY, yFactor))
+      {
+        return Error("Can not downsample " + std::to_string(pwgHdr.HWResolutionX) + "x" +
+                     std::to_string(pwgHdr.HWResolutionY) + " to " +
+                     std::to_string(resX) + "x" + std::to_string(resY) + " DPI");
+      }
+      width = pwgHdr.Width;
+      height = pwgHdr.Height;
+      colors = pwgHdr.NumColors;
+      bits = pwgHdr.BitsPerColor;
+
+      pwgHdr.Width = width / xFactor;
+      pwgHdr.Height = height / yFactor;
+      pwgHdr.HWResolutionX = resX;
+      pwgHdr.HWResolutionY = resY;
+      pwgHdr.BytesPerLine = raster_byte_width(pwgHdr.Width, colors, bits);
+      pwgHdr.ImageBoxLeft /= xFactor;
+      pwgHdr.ImageBoxRight /= xFactor;
+      pwgHdr.ImageBoxTop /= yFactor;
+      pwgHdr.ImageBoxBottom /= yFactor;
+      pwgHdr.encodeInto(outBts);
+    }
+
+    resample_page(in, outBts, width, height, colors, bits, xFactor, yFactor, mode, urf);
+
+    if(!writeFun(std::move(outBts)))
+    {
+      return Error("Write error");
+    }
+    outBts = Bytestream();
+
+    // URF knows its page count up front, for PWG it is unknown (0)
+    progressFun(page, pageCount);
+  }
+
+  return Error();
+}
+
+Error resample_raster(Bytestream& inBts, uint32_t resX, uint32_t resY,
+                      LineResampler::Mode mode, const WriteFun& writeFun,
+                      const ProgressFun& progressFun)
+{
+  RasterSource in(inBts);
+  return resample_raster(in, resX, resY, mode, writeFun, progressFun);
+}
+
+Error resample_raster(std::istream& in, uint32_t resX, uint32_t resY,
+                      LineResampler::Mode mode, const WriteFun& writeFun,
+                      const ProgressFun& progressFun)
+{
+  RasterSource source(in);
+  return resample_raster(source, resX, resY, mode, writeFun, progressFun);
+}
@@ -0,0 +1,82 @@
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include "array.h"
+#include "bytestream.h"
+#include "error.h"
+#include "functions.h"
+
+#include <istream>
+
+class LineResampler
+{
+public:
+  enum Mode
+  {
+    BoxFilter,
+    Decimate
+  };
+
+  LineResampler() = delete;
+  LineResampler(const LineResampler&) = delete;
+  LineResampler& operator=(const LineResampler&) = delete;
+
+  LineResampler(size_t width, size_t colors, size_t bits,
+                size_t xFactor, size_t yFactor, Mode mode=BoxFilter);
+
+  // Returns true when enough lines have been added to produce an output line
+  bool addLine(const uint8_t* inLine);
+
+  const uint8_t* line() const
+  {
+    return _outLine;
+  }
+
+  size_t outWidth() const
+  {
+    return _outWidth;
+  }
+
+  size_t outByteWidth() const
+  {
+    return _outByteWidth;
+  }
+
+private:
+  uint32_t sampleAt(const uint8_t* inLine, size_t i) const;
+  void accumulate(const uint8_t* inLine);
+  void emit();
+
+  size_t _colors;
+  size_t _bits;
+  size_t _xFactor;
+  size_t _yFactor;
+  Mode _mode;
+
+  size_t _outWidth;
+  size_t _outByteWidth;
+  size_t _lineNo = 0;
+
+  Array<uint32_t> _sums;
+  Array<uint8_t> _outLine;
+};
+
+void downsample_bitmap(Bytestream& outBts, const uint8_t* bmp,
+                       size_t width, size_t height, size_t colors, size_t bits,
+                       size_t xFactor, size_t yFactor,
+                       LineResampler::Mode mode=LineResampler::BoxFilter);
+
+// Integer factor from fromRes to toRes, false if it does not divide evenly
+bool downsample_factor(uint32_t fromRes, uint32_t toRes, size_t& factor);
+
+bool raster_resolution(Bytestream& inBts, uint32_t& resX, uint32_t& resY);
+
+Error resample_raster(Bytestream& inBts, uint32_t resX, uint32_t resY,
+                      LineResampler::Mode mode, const WriteFun& writeFun,
+                      const ProgressFun& progressFun = noOpProgressfun);
+// Reads the raster as it goes, holding a little more than a line at a time
+Error resample_raster(std::istream& in, uint32_t resX, uint32_t resY,
+                      LineResampler::Mode mode, const WriteFun& writeFun,
+                      const ProgressFun& progressFun = noOpProgressfun);
+
+#endif //RESAMPLE_H
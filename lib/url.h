@@ -1,6 +1,7 @@
 #ifndef URL_H
 #define URL_H
 
+#include <cctype>
 #include <cstdint>
 #include <string>
 #include <regex>
@@ -88,11 +89,49 @@ public:
     _path = std::move(path);
   }
 
+  // ipp+unix://%2Frun%2Fipp.sock/ipp/print is ipp://localhost/ipp/print
+  // over the Unix domain socket /run/ipp.sock
+  bool isUnixSocket() const
+  {
+    return _scheme.size() > 5 && _scheme.compare(_scheme.size() - 5, 5, "+unix") == 0;
+  }
+
+  std::string getSocketPath() const
+  {
+    std::string path;
+    for(size_t i = 0; i < _host.size(); i++)
+    {
+      if(_host[i] == '%' && i + 2 < _host.size()
+         && std::isxdigit(_host[i + 1]) && std::isxdigit(_host[i + 2]))
+      {
+        path += (char)std::stoul(_host.substr(i + 1, 2), nullptr, 16);
+        i += 2;
+      }
+      else
+      {
+        path += _host[i];
+      }
+    }
+    return path;
+  }
+
+  // The address as the server on the other end of the socket knows it
+  Url localUrl() const
+  {
+    Url url = *this;
+    if(isUnixSocket())
+    {
+      url._scheme.resize(_scheme.size() - 5);
+      url._host = "localhost";
+    }
+    return url;
+  }
+
 private:
 
   void match(const std::string& str)
   {
-    static const std::regex regex("(([a-z]+)://)((\\[[:a-zA-Z0-9]+\\])|([a-zA-Z0-9-.]*))(:([0-9]+))?(/.*)?$");
+    static const std::regex regex("(([a-z]+(\\+unix)?)://)((\\[[:a-zA-Z0-9]+\\])|([a-zA-Z0-9-.%]*))(:([0-9]+))?(/.*)?$");
     std::smatch match;
 
     _valid = false;
@@ -105,9 +144,9 @@ private:
     {
       _valid = true;
       _scheme = match[2];
-      _host = match[3];
-      _port = match[7] == "" ? 0 : stoul(match[7]);
-      _path = match[8];
+      _host = match[4];
+      _port = match[8] == "" ? 0 : stoul(match[8]);
+      _path = match[9];
     }
   }
 
@@ -0,0 +1,69 @@
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include "list.h"
+#include "lthread.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+
+// Hands out the indexes 0..count-1 to workers on up to a given number of threads,
+// and collects their errors. Each worker takes indexes until there are none left,
+// so it can keep its own state for all the items it processes.
+class WorkerPool
+{
+public:
+  WorkerPool() = delete;
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  WorkerPool(size_t count) : _count(count)
+  {}
+
+  // Returns false when all indexes have been handed out
+  bool next(size_t& index)
+  {
+    index = _next++;
+    return index < _count;
+  }
+
+  void addError(const std::string& error)
+  {
+    std::lock_guard<std::mutex> lock(_errorLock);
+    _errors.push_back(error);
+  }
+
+  // Runs the worker on up to jobs threads, or just in this one if only one is needed
+  void run(size_t jobs, const LThread::runnable& worker)
+  {
+    size_t workerCount = std::min(jobs, _count);
+    if(workerCount > 1)
+    {
+      List<LThread> workers;
+      for(size_t i = 0; i < workerCount; i++)
+      {
+        workers.emplace_back();
+        workers.back().run(worker);
+      }
+    }
+    else
+    {
+      worker();
+    }
+  }
+
+  const List<std::string>& errors() const
+  {
+    return _errors;
+  }
+
+private:
+  size_t _count;
+  std::atomic<size_t> _next = 0;
+  std::mutex _errorLock;
+  List<std::string> _errors;
+};
+
+#endif // WORKERPOOL_H
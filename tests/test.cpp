@@ -3,15 +3,28 @@
 #include "pwgpghdr.h"
 #include "pwg2ppm.h"
 #include "printparameters.h"
+#include "resample.h"
 #include "argget.h"
+#include "binfile.h"
 #include "lthread.h"
+#include "workerpool.h"
+#include "ippfleet.h"
 #include "ippmsg.h"
 #include "ippprinter.h"
 #include "ippprintjob.h"
 #include "json11.hpp"
+#include "compressiontuner.h"
+#include "holdingwriter.h"
 #include "url.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstring>
 #include <filesystem>
+#include <iterator>
+#include <sstream>
+#include <thread>
+#include <vector>
 using namespace std;
 using namespace json11;
 
@@ -119,6 +132,24 @@ Bytestream Rotated()
   return enc;
 }
 
+// Pacman with every pixel doubled in both directions
+Bytestream PacmanPpm2x()
+{
+  Bytestream ppm = PacmanPpm<uint8_t>();
+  ppm >>= "P6\n8 8\n255\n";
+  size_t offset = ppm.pos();
+  Bytestream big {string("P6\n16 16\n255\n")};
+  for(size_t y = 0; y < 16; y++)
+  {
+    for(size_t x = 0; x < 16; x++)
+    {
+      ppm.setPos(offset + ((((y / 2) * 8) + (x / 2)) * 3));
+      big << ppm.getBytestream(3);
+    }
+  }
+  return big;
+}
+
 Bytestream P4_0101()
 {
   Bytestream ppm {string("P4\n24 8\n")};
@@ -229,6 +260,52 @@ TEST(ppm2pwg)
   ASSERT(pwg == expected_pwg);
 }
 
+TEST(ppm2pwg_mapped)
+{
+  // Input from a regular file is parsed in place rather than streamed
+  std::ifstream ppm_ifs("pacman.ppm");
+  Bytestream ppm(ppm_ifs);
+  Bytestream twoPages;
+  twoPages << ppm << ppm;
+  std::string inFile = string(__func__) + ".ppm";
+  std::string outFile = string(__func__) + ".pwg";
+  std::ofstream(inFile, std::ios::binary) << twoPages;
+  std::filesystem::remove(outFile);
+
+  FILE* proc = popen(("../ppm2pwg " + inFile + " " + outFile).c_str(), "r");
+  ASSERT(proc != nullptr);
+  ASSERT(pclose(proc) == 0);
+  std::ifstream pwg_ifs(outFile);
+  Bytestream pwg(pwg_ifs);
+  ASSERT(pwg.size() != 0);
+
+  // Both pages made it
+  ASSERT(pwg >>= "RaS2");
+  for(int page = 0; page < 2; page++)
+  {
+    PwgPgHdr hdr;
+    hdr.decodeFrom(pwg);
+    ASSERT(hdr.Width == 8);
+    ASSERT(hdr.Height == 8);
+    skip_raster_page(pwg, hdr.Width, hdr.Height, 3, 8, false);
+  }
+  ASSERT(pwg.atEnd());
+
+  pwg.setPos(0);
+  ASSERT(pwg == run_ppm2pwg({}, twoPages, "ppm2pwg_streamed.pwg"));
+}
+
+TEST(ppm2pwg_parallel)
+{
+  Bytestream pages;
+  pages << PacmanPpm<uint8_t>() << PacmanPpm2x() << PacmanPpm<uint8_t>()
+        << PacmanPpm<uint8_t>() << PacmanPpm2x();
+
+  Bytestream expected = run_ppm2pwg({"-d", "-b", "flip"}, pages, "ppm2pwg_serial.pwg");
+  ASSERT(run_ppm2pwg({"-j", "3", "-d", "-b", "flip"}, pages, __func__) == expected);
+  ASSERT(run_ppm2pwg({"-j", "8", "-d", "-b", "flip"}, pages, __func__) == expected);
+}
+
 TEST(ppm2pwg_16bit)
 {
   Bytestream ppm = PacmanPpm<uint16_t>();
@@ -245,6 +322,55 @@ TEST(ppm2pwg_16bit)
   ASSERT(pwg.atEnd());
 }
 
+TEST(ppm2pwg_downsample)
+{
+  std::ifstream ifs("pacman.pwg");
+  Bytestream expected_pwg(ifs);
+
+  Bytestream pwg = run_ppm2pwg({"-r", "600", "-tr", "300"}, PacmanPpm2x(), __func__);
+  ASSERT(pwg == expected_pwg);
+
+  pwg = run_ppm2pwg({"-r", "600", "-tr", "300", "--decimate"}, PacmanPpm2x(), __func__);
+  ASSERT(pwg == expected_pwg);
+
+  // 600 is not a whole multiple of 250
+  pwg = run_ppm2pwg({"-r", "600", "-tr", "250"}, PacmanPpm2x(), __func__);
+  ASSERT(pwg.size() == 0);
+}
+
+TEST(resample_raster)
+{
+  std::ifstream ifs("pacman.pwg");
+  Bytestream expected_pwg(ifs);
+  Bytestream pwg = run_ppm2pwg({"-r", "600"}, PacmanPpm2x(), __func__);
+
+  uint32_t resX = 0;
+  uint32_t resY = 0;
+  ASSERT(raster_resolution(pwg, resX, resY));
+  ASSERT(resX == 600);
+  ASSERT(resY == 600);
+  ASSERT(pwg.pos() == 0);
+
+  Bytestream out;
+  WriteFun writeFun([&out](Bytestream&& data)
+  {
+    out << data;
+    return true;
+  });
+
+  ASSERT(!resample_raster(pwg, 300, 300, LineResampler::BoxFilter, writeFun));
+  ASSERT(out == expected_pwg);
+
+  pwg.setPos(0);
+  ASSERT(resample_raster(pwg, 250, 250, LineResampler::BoxFilter, writeFun));
+
+  Bytestream expected_urf = run_ppm2pwg({"-f", "urf"}, PacmanPpm<uint8_t>(), "pacman.urf");
+  Bytestream urf = run_ppm2pwg({"-f", "urf", "-r", "600"}, PacmanPpm2x(), __func__);
+  out = Bytestream();
+  ASSERT(!resample_raster(urf, 300, 300, LineResampler::Decimate, writeFun));
+  ASSERT(out == expected_urf);
+}
+
 template <typename T>
 void basic_pacman_asserts(const PwgPgHdr& hdr)
 {
@@ -584,6 +710,142 @@ TEST(bilevel_rotated)
   ASSERT(pwg.atEnd());
 }
 
+TEST(skip_raster_page)
+{
+  std::ifstream ifs("pacman.pwg");
+  Bytestream pwg(ifs);
+  ASSERT(pwg >>= "RaS2");
+  PwgPgHdr hdr;
+  hdr.decodeFrom(pwg);
+  size_t pageStart = pwg.pos();
+  skip_raster_page(pwg, hdr.Width, hdr.Height, hdr.NumColors, hdr.BitsPerColor, false);
+  ASSERT(pwg.atEnd());
+
+  Bytestream truncated(pwg.raw(), pwg.size() - 1);
+  truncated.setPos(pageStart);
+  ASSERT_THROW(skip_raster_page(truncated, hdr.Width, hdr.Height, hdr.NumColors, hdr.BitsPerColor, false),
+               out_of_range);
+}
+
+TEST(raster_to_thumbnail)
+{
+  std::ifstream ifs("pacman.pwg");
+  Bytestream pwg(ifs);
+  ASSERT(pwg >>= "RaS2");
+  PwgPgHdr hdr;
+  hdr.decodeFrom(pwg);
+  size_t pageStart = pwg.pos();
+
+  Bytestream bmp;
+  raster_to_bmp(bmp, pwg, hdr.Width, hdr.Height, 3, 8, false);
+
+  for(size_t step : {1, 2, 3, 5, 9})
+  {
+    pwg.setPos(pageStart);
+    Bytestream thumb;
+    raster_to_thumbnail(thumb, pwg, hdr.Width, hdr.Height, 3, 8, false, step);
+    ASSERT(pwg.atEnd());
+
+    size_t width = thumbnail_dimension(hdr.Width, step);
+    size_t height = thumbnail_dimension(hdr.Height, step);
+    ASSERT(thumb.size() == width * height * 3);
+    for(size_t y = 0; y < height; y++)
+    {
+      for(size_t x = 0; x < width; x++)
+      {
+        ASSERT(memcmp(thumb.raw() + (((y * width) + x) * 3),
+                      bmp.raw() + (((y * step * hdr.Width) + (x * step)) * 3), 3) == 0);
+      }
+    }
+  }
+
+  // 1-bit black, where pixels are picked out of the bits
+  Bytestream bilevel = BilevelPwg0101();
+  Bytestream bilevelBmp;
+  raster_to_bmp(bilevelBmp, bilevel, 24, 8, 1, 1, false);
+  ASSERT(bilevelBmp.size() == 3 * 8);
+
+  for(size_t step : {1, 2, 3, 5, 9})
+  {
+    bilevel.setPos(0);
+    Bytestream thumb;
+    raster_to_thumbnail(thumb, bilevel, 24, 8, 1, 1, false, step);
+    ASSERT(bilevel.atEnd());
+
+    size_t width = thumbnail_dimension(24, step);
+    size_t height = thumbnail_dimension(8, step);
+    size_t byteWidth = raster_byte_width(width, 1, 1);
+    ASSERT(thumb.size() == byteWidth * height);
+    for(size_t y = 0; y < height; y++)
+    {
+      for(size_t x = 0; x < width; x++)
+      {
+        size_t inX = x * step;
+        bool thumbBit = thumb.raw()[(y * byteWidth) + (x / 8)] & (0x80 >> (x % 8));
+        bool bmpBit = bilevelBmp.raw()[(y * step * 3) + (inX / 8)] & (0x80 >> (inX % 8));
+        ASSERT(thumbBit == bmpBit);
+      }
+      // Padding bits are left clear
+      for(size_t x = width; x < byteWidth * 8; x++)
+      {
+        ASSERT_FALSE(thumb.raw()[(y * byteWidth) + (x / 8)] & (0x80 >> (x % 8)));
+      }
+    }
+  }
+}
+
+TEST(buffered_out_file)
+{
+  Bytestream small {string("header\n")};
+  Bytestream large(10000, 0x42);
+  {
+    BufferedOutFile outFile("buffered_out_file", 4096);
+    ASSERT(outFile);
+    ASSERT(outFile.write(small));
+    // Too large for the buffer, gets written together with what is buffered
+    ASSERT(outFile.write(large));
+    outFile << small;
+  }
+  std::ifstream ifs("buffered_out_file");
+  Bytestream written(ifs);
+  Bytestream expected;
+  expected << small << large << small;
+  ASSERT(written == expected);
+
+  BufferedOutFile badFile("/nonexistent/buffered_out_file");
+  ASSERT_FALSE(badFile);
+  ASSERT_FALSE(badFile.write(small));
+}
+
+TEST(write_ppm_cmyk)
+{
+  Bytestream cmyk;
+  cmyk << (uint8_t)0 << (uint8_t)0 << (uint8_t)0 << (uint8_t)0
+       << (uint8_t)255 << (uint8_t)0 << (uint8_t)0 << (uint8_t)0
+       << (uint8_t)0 << (uint8_t)0 << (uint8_t)0 << (uint8_t)255
+       << (uint8_t)200 << (uint8_t)0 << (uint8_t)50 << (uint8_t)100;
+  write_ppm(cmyk, 2, 2, 4, 8, false, __func__, 1);
+
+  std::ifstream ifs(string(__func__) + "1.ppm");
+  Bytestream ppm(ifs);
+  Bytestream expected {string("P6\n2 2\n255\n")};
+  expected << (uint8_t)255 << (uint8_t)255 << (uint8_t)255
+           << (uint8_t)0 << (uint8_t)255 << (uint8_t)255
+           << (uint8_t)0 << (uint8_t)0 << (uint8_t)0
+           << (uint8_t)0 << (uint8_t)155 << (uint8_t)105;
+  ASSERT(ppm == expected);
+
+  Bytestream cmyk16;
+  cmyk16 << (uint16_t)0x1000 << (uint16_t)0 << (uint16_t)0xffff << (uint16_t)0x0100;
+  write_ppm(cmyk16, 1, 1, 4, 16, false, __func__, 2);
+
+  std::ifstream ifs16(string(__func__) + "2.ppm");
+  Bytestream ppm16(ifs16);
+  Bytestream expected16 {string("P6\n1 1\n65535\n")};
+  expected16 << (uint16_t)0xeeff << (uint16_t)0xfeff << (uint16_t)0;
+  ASSERT(ppm16 == expected16);
+}
+
 bool close_enough(int a, int b, unsigned int precision)
 {
   int lower = b - precision;
@@ -1562,6 +1824,39 @@ TEST(lthread)
   ltr.await();
 }
 
+TEST(workerpool)
+{
+  std::vector<std::atomic<int>> done(100);
+  WorkerPool pool(done.size());
+  pool.run(4, [&pool, &done]()
+  {
+    for(size_t i = 0; pool.next(i);)
+    {
+      done[i]++;
+      if(i % 10 == 0)
+      {
+        pool.addError(std::to_string(i));
+      }
+    }
+  });
+  ASSERT(std::all_of(done.begin(), done.end(), [](const std::atomic<int>& d){return d == 1;}));
+  ASSERT(pool.errors().size() == 10);
+
+  // Nothing to do
+  WorkerPool emptyPool(0);
+  size_t calls = 0;
+  emptyPool.run(4, [&emptyPool, &calls]()
+  {
+    calls++;
+    for(size_t i = 0; emptyPool.next(i);)
+    {
+      calls++;
+    }
+  });
+  ASSERT(calls == 1);
+  ASSERT(emptyPool.errors().empty());
+}
+
 TEST(ippattr)
 {
 
@@ -2149,6 +2444,21 @@ TEST(finalize)
   // PrintParameters only used for PDF input
   ASSERT(ip.printParams.format == PrintParameters::Invalid);
 
+  // Converted locally to raster
+  ip = IppPrintJob(printerAttrs);
+  ip.documentFormat.set("image/pwg-raster");
+  ip.scaling.set("fill");
+  ip.finalize("image/jpeg");
+  ASSERT(ip.printParams.format == PrintParameters::PWG);
+  ASSERT(ip.printParams.scaling == PrintParameters::Fill);
+  ASSERT_FALSE(ip.jobAttrs.has("print-scaling"));
+
+  // Sent as-is, the printer does the scaling
+  ip = IppPrintJob(printerAttrs);
+  ip.scaling.set("fill");
+  ip.finalize("image/jpeg");
+  ASSERT(ip.jobAttrs.get<std::string>("print-scaling") == "fill");
+
   // Forget choices
   ip = IppPrintJob(printerAttrs);
 
@@ -2475,7 +2785,7 @@ TEST(converter)
   // PDF maps to PWG-raster
   supportedFormats = {"image/pwg-raster"};
   ASSERT(Converter::instance().possibleInputFormats(supportedFormats)
-         == (List<std::string> {"application/pdf", "image/pwg-raster"}));
+         == (List<std::string> {"application/pdf", "image/jpeg", "image/pwg-raster"}));
   ASSERT(Converter::instance().getTargetFormat("application/pdf", supportedFormats)
          == "image/pwg-raster");
   ASSERT(Converter::instance().possibleOutputFormats(supportedFormats, "application/pdf")
@@ -2484,7 +2794,7 @@ TEST(converter)
   // ...and URF
   supportedFormats = {"image/urf"};
   ASSERT(Converter::instance().possibleInputFormats(supportedFormats)
-         == (List<std::string> {"application/pdf", "image/urf"}));
+         == (List<std::string> {"application/pdf", "image/jpeg", "image/urf"}));
   ASSERT(Converter::instance().getTargetFormat("application/pdf", supportedFormats)
          == "image/urf");
   ASSERT(Converter::instance().possibleOutputFormats(supportedFormats, "application/pdf")
@@ -2493,7 +2803,7 @@ TEST(converter)
   // PDF has higher prio than raster
   supportedFormats = {"image/pwg-raster", "application/pdf"};
   ASSERT(Converter::instance().possibleInputFormats(supportedFormats)
-         == (List<std::string> {"application/pdf", "image/pwg-raster"}));
+         == (List<std::string> {"application/pdf", "image/jpeg", "image/pwg-raster"}));
   ASSERT(Converter::instance().getTargetFormat("application/pdf", supportedFormats)
          == "application/pdf");
   ASSERT(Converter::instance().possibleOutputFormats(supportedFormats, "application/pdf")
@@ -2502,7 +2812,7 @@ TEST(converter)
   // Octet Stream, because why not
   supportedFormats = {"application/octet-stream", "image/pwg-raster", "application/pdf"};
   ASSERT(Converter::instance().possibleInputFormats(supportedFormats)
-         == (List<std::string> {"application/pdf", "application/octet-stream", "image/pwg-raster"}));
+         == (List<std::string> {"application/pdf", "image/jpeg", "application/octet-stream", "image/pwg-raster"}));
   ASSERT(Converter::instance().getTargetFormat("application/pdf", supportedFormats)
          == "application/pdf");
   ASSERT(Converter::instance().possibleOutputFormats(supportedFormats, "application/pdf")
@@ -2520,26 +2830,33 @@ TEST(converter)
   // Postscript has higher prio than raster
   supportedFormats = {"image/pwg-raster", "application/postscript"};
   ASSERT(Converter::instance().possibleInputFormats(supportedFormats)
-         == (List<std::string> {"application/pdf", "image/pwg-raster", "application/postscript"}));
+         == (List<std::string> {"application/pdf", "image/jpeg", "image/pwg-raster", "application/postscript"}));
   ASSERT(Converter::instance().getTargetFormat("application/pdf", supportedFormats)
          == "application/postscript");
   ASSERT(Converter::instance().possibleOutputFormats(supportedFormats, "application/pdf")
          == (List<std::string> {"application/postscript", "image/pwg-raster"}));
 
-  // JPEG needs JPEG support
+  // JPEG gets rasterized without JPEG support...
+  ASSERT(Converter::instance().getTargetFormat("image/jpeg", supportedFormats) == "image/pwg-raster");
+  ASSERT(Converter::instance().possibleOutputFormats(supportedFormats, "image/jpeg")
+         == List<std::string> {"image/pwg-raster"});
+  supportedFormats = {"application/postscript"};
   ASSERT_FALSE(Converter::instance().getTargetFormat("image/jpeg", supportedFormats));
   ASSERT(Converter::instance().possibleOutputFormats(supportedFormats, "image/jpeg")
          == List<std::string> {});
+  // ...but is sent as JPEG when possible
   supportedFormats = {"application/octet-stream", "image/pwg-raster", "application/pdf", "image/jpeg"};
   ASSERT(Converter::instance().getTargetFormat("image/jpeg", supportedFormats) == "image/jpeg");
   ASSERT(Converter::instance().possibleOutputFormats(supportedFormats, "image/jpeg")
-         == (List<std::string> {"image/jpeg"}));
+         == (List<std::string> {"image/jpeg", "image/pwg-raster"}));
 
   // Functions exist. TODO: Check that they are the correct ones.
   ASSERT(Converter::instance().getConvertFun("application/pdf", "application/pdf"));
   ASSERT(Converter::instance().getConvertFun("application/pdf", "image/pwg-raster"));
   ASSERT(Converter::instance().getConvertFun("application/pdf", "image/urf"));
   ASSERT(Converter::instance().getConvertFun("image/jpeg", "image/jpeg"));
+  ASSERT(Converter::instance().getConvertFun("image/jpeg", "image/pwg-raster"));
+  ASSERT(Converter::instance().getConvertFun("image/jpeg", "image/urf"));
   ASSERT(Converter::instance().getConvertFun("text/plain", "text/plain"));
   ASSERT(Converter::instance().getConvertFun("foo", "foo"));
 
@@ -2558,7 +2875,7 @@ TEST(converter)
   Converter::instance().Pipelines.push_back({{"application/pdf", "application/aaa"}, FooBar});
   supportedFormats = {"image/pwg-raster", "application/pdf", "application/aaa"};
   ASSERT(Converter::instance().possibleInputFormats(supportedFormats)
-         == (List<std::string> {"application/pdf", "image/pwg-raster", "application/aaa"}));
+         == (List<std::string> {"application/pdf", "image/jpeg", "image/pwg-raster", "application/aaa"}));
   ASSERT(Converter::instance().getTargetFormat("application/pdf", supportedFormats)
          == "application/pdf");
   ASSERT(Converter::instance().possibleOutputFormats("application/pdf")
@@ -2582,6 +2899,421 @@ TEST(converter)
 
 }
 
+TEST(converter_resample_raster)
+{
+  std::ifstream ifs("pacman.pwg");
+  Bytestream expected_pwg(ifs);
+  run_ppm2pwg({"-r", "600"}, PacmanPpm2x(), __func__);
+
+  Bytestream out;
+  WriteFun writeFun([&out](Bytestream&& data)
+  {
+    out << data;
+    return true;
+  });
+  ProgressFun progressFun([](size_t, size_t){});
+
+  // Raster passed through to a printer that only takes a lower resolution
+  IppAttrs printerAttrs =
+    {{"document-format-supported", IppAttr(IppTag::MimeMediaType, IppOneSetOf {"image/pwg-raster",
+                                                                               "image/urf"})},
+     {"pwg-raster-document-resolution-supported", IppAttr(IppTag::Resolution, IppResolution {300, 300, 3})},
+     {"urf-supported", IppAttr(IppTag::Keyword, IppOneSetOf {"RS300", "W8"})}};
+  IppPrintJob job(printerAttrs);
+  ASSERT_FALSE(job.finalize("image/pwg-raster"));
+  ASSERT(job.targetFormat == "image/pwg-raster");
+  std::optional<Converter::ConvertFun> convertFun =
+    Converter::instance().getConvertFun("image/pwg-raster", "image/pwg-raster");
+  ASSERT(convertFun);
+  ASSERT_FALSE((*convertFun)(__func__, job, writeFun, progressFun));
+  ASSERT(out == expected_pwg);
+
+  // ...same for URF
+  Bytestream expected_urf = run_ppm2pwg({"-f", "urf"}, PacmanPpm<uint8_t>(), "pacman.urf");
+  run_ppm2pwg({"-f", "urf", "-r", "600"}, PacmanPpm2x(), __func__);
+  IppPrintJob urfJob(printerAttrs);
+  ASSERT_FALSE(urfJob.finalize("image/urf"));
+  ASSERT(urfJob.targetFormat == "image/urf");
+  out = Bytestream();
+  convertFun = Converter::instance().getConvertFun("image/urf", "image/urf");
+  ASSERT(convertFun);
+  ASSERT_FALSE((*convertFun)(__func__, urfJob, writeFun, progressFun));
+  ASSERT(out == expected_urf);
+
+  // Resolutions the printer takes are sent as-is
+  run_ppm2pwg({"-f", "urf"}, PacmanPpm<uint8_t>(), __func__);
+  out = Bytestream();
+  ASSERT_FALSE((*convertFun)(__func__, urfJob, writeFun, progressFun));
+  ASSERT(out == expected_urf);
+}
+
+TEST(write_in_chunks)
+{
+  string data(2500, 'x');
+  std::istringstream in(data);
+  List<size_t> sizes;
+  Bytestream out;
+  ASSERT(write_in_chunks(in, [&sizes, &out](Bytestream&& chunk)
+                             {
+                               sizes.push_back(chunk.size());
+                               out << chunk;
+                               return true;
+                             }, 1000));
+  ASSERT(sizes == (List<size_t> {1000, 1000, 500}));
+  ASSERT(out == Bytestream {data});
+
+  // Stops at the first failed write
+  std::istringstream in2(data);
+  size_t writes = 0;
+  ASSERT_FALSE(write_in_chunks(in2, [&writes](Bytestream&&)
+                                    {
+                                      writes++;
+                                      return false;
+                                    }, 1000));
+  ASSERT(writes == 1);
+}
+
+TEST(crlf_normalizer)
+{
+  string text = "unix\ndos\r\nmac\rmixed\r\n\n\r\r\nend\n";
+  string expected = "unix\r\ndos\r\nmac\rmixed\r\n\r\n\r\r\nend\r\n";
+
+  // Every split into two chunks, including between CR and LF
+  for(size_t split = 0; split <= text.size(); split++)
+  {
+    Bytestream out;
+    WriteFun writeFun([&out](Bytestream&& data)
+    {
+      out << data;
+      return true;
+    });
+    CrlfNormalizer normalizer(writeFun);
+    ASSERT(normalizer.write(reinterpret_cast<const uint8_t*>(text.data()), split));
+    ASSERT(normalizer.write(reinterpret_cast<const uint8_t*>(text.data()) + split, text.size() - split));
+    ASSERT(out == Bytestream(expected.data(), expected.size()));
+  }
+}
+
+TEST(parallel_deflate)
+{
+  string text;
+  for(size_t i = 0; i < 10000; i++)
+  {
+    text += "line " + to_string(i * i % 997) + "\n";
+  }
+
+  for(ParallelDeflate::Format format : {ParallelDeflate::Raw, ParallelDeflate::Gzip})
+  {
+    // Small blocks and uneven writes, so data is both split and held back
+    ParallelDeflate deflater(format, 3, Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY, 1000);
+    List<std::future<ParallelDeflate::Block>> blocks;
+    for(size_t pos = 0; pos < text.size(); pos += 2345)
+    {
+      size_t size = std::min<size_t>(2345, text.size() - pos);
+      blocks.splice(blocks.end(), deflater.compress(Bytestream(text.data() + pos, size)));
+    }
+    blocks.splice(blocks.end(), deflater.flush());
+    Bytestream compressed;
+    for(std::future<ParallelDeflate::Block>& block : blocks)
+    {
+      compressed << deflater.join(block.get());
+    }
+    compressed << deflater.finish();
+
+    // One stream, that inflates with the small window it was made for
+    z_stream strm {};
+    ASSERT(inflateInit2(&strm, format == ParallelDeflate::Gzip ? 16 + 11 : -11) == Z_OK);
+    Bytestream inflated(text.size() + 1);
+    strm.next_in = compressed.raw();
+    strm.avail_in = compressed.size();
+    strm.next_out = inflated.raw();
+    strm.avail_out = inflated.size();
+    ASSERT(inflate(&strm, Z_FINISH) == Z_STREAM_END);
+    ASSERT(strm.avail_in == 0);
+    ASSERT(strm.total_out == text.size());
+    ASSERT(memcmp(inflated.raw(), text.data(), text.size()) == 0);
+    inflateEnd(&strm);
+  }
+
+  // Nothing written still makes a valid, empty stream
+  ParallelDeflate deflater(ParallelDeflate::Gzip, 1);
+  Bytestream empty = deflater.finish();
+  z_stream strm {};
+  uint8_t out[1];
+  ASSERT(inflateInit2(&strm, 16 + 15) == Z_OK);
+  strm.next_in = empty.raw();
+  strm.avail_in = empty.size();
+  strm.next_out = out;
+  strm.avail_out = 1;
+  ASSERT(inflate(&strm, Z_FINISH) == Z_STREAM_END);
+  ASSERT(strm.total_out == 0);
+  inflateEnd(&strm);
+}
+
+TEST(compression_tuner)
+{
+  // Decided by format alone
+  CompressionTuner jpegTuner(MiniMime::JPEG);
+  ASSERT(jpegTuner.addSample(Bytestream(100, (uint8_t)0)));
+  ASSERT_FALSE(jpegTuner.choose().enabled);
+
+  // Collects a full trial's worth
+  CompressionTuner rasterTuner(MiniMime::PWG);
+  ASSERT_FALSE(rasterTuner.addSample(Bytestream(CompressionTuner::TrialSize / 2, (uint8_t)0)));
+  ASSERT(rasterTuner.addSample(Bytestream(CompressionTuner::TrialSize, (uint8_t)0)));
+  CompressionChoice rasterChoice = rasterTuner.choose();
+  ASSERT(rasterChoice.enabled);
+  ASSERT(rasterChoice.strategy == Z_RLE);
+  ASSERT(rasterChoice.ratio < 0.01);
+
+  // Noise doesn't compress
+  Bytestream noise;
+  uint32_t x = 1;
+  for(size_t i = 0; i < 10000; i++)
+  {
+    x = x * 1103515245 + 12345;
+    noise << (uint8_t)(x >> 16);
+  }
+  CompressionTuner pdfTuner(MiniMime::PDF);
+  ASSERT_FALSE(pdfTuner.addSample(noise));
+  CompressionChoice pdfChoice = pdfTuner.choose();
+  ASSERT_FALSE(pdfChoice.enabled);
+  ASSERT(pdfChoice.strategy == Z_DEFAULT_STRATEGY);
+  ASSERT(pdfChoice.ratio > CompressionTuner::MaxRatio);
+
+  // Nor does nothing
+  CompressionTuner emptyTuner(MiniMime::PDF);
+  ASSERT_FALSE(emptyTuner.choose().enabled);
+}
+
+TEST(is_sequential_jpeg)
+{
+  Bytestream soi {(uint8_t)0xFF, (uint8_t)0xD8};
+  Bytestream app0 {(uint8_t)0xFF, (uint8_t)0xE0, (uint16_t)6, "JFIF"};
+  Bytestream dqt {(uint8_t)0xFF, (uint8_t)0xDB, (uint16_t)3, (uint8_t)0};
+
+  bool replayed = true;
+  auto check = [&](uint8_t sof)
+  {
+    // Starts one byte in, with a fill byte before the frame header
+    Bytestream jpeg;
+    jpeg << (uint8_t)0 << soi << app0 << dqt << (uint8_t)0xFF << (uint8_t)0xFF << sof
+         << (uint16_t)11 << (uint8_t)8 << (uint16_t)16 << (uint16_t)16
+         << (uint8_t)1 << (uint8_t)1 << (uint8_t)0x11 << (uint8_t)0 << "scan data";
+    std::string jpegStr(reinterpret_cast<const char*>(jpeg.raw()), jpeg.size());
+    std::istringstream in(jpegStr);
+    in.get();
+    Bytestream head = read_jpeg_head(in);
+    bool res = is_sequential_jpeg(head);
+    // Nothing is lost, as if the stream had not been looked at
+    PrefixedInStream replay(std::move(head), in);
+    std::string rest((std::istreambuf_iterator<char>(replay)), std::istreambuf_iterator<char>());
+    replayed = replayed && rest == jpegStr.substr(1);
+    return res;
+  };
+
+  ASSERT(check(0xC0));
+  ASSERT(check(0xC1));
+  // Progressive, lossless and arithmetic-coded
+  ASSERT_FALSE(check(0xC2));
+  ASSERT_FALSE(check(0xC3));
+  ASSERT_FALSE(check(0xC9));
+  ASSERT_FALSE(check(0xCA));
+  // Scan without a frame header
+  ASSERT_FALSE(check(0xDA));
+  ASSERT(replayed);
+
+  std::istringstream notJpeg("P6\n8 8\n255\n");
+  Bytestream head = read_jpeg_head(notJpeg);
+  ASSERT_FALSE(is_sequential_jpeg(head));
+  ASSERT(head.size() == 1);
+}
+
+TEST(jpeg_downscale_eighths)
+{
+  auto eighths = [](uint16_t width, uint16_t height)
+  {
+    Bytestream jpeg;
+    jpeg << (uint8_t)0xFF << (uint8_t)0xD8
+         << (uint8_t)0xFF << (uint8_t)0xC2 << (uint16_t)11 << (uint8_t)8 << height << width
+         << (uint8_t)1 << (uint8_t)1 << (uint8_t)0x11 << (uint8_t)0;
+    std::istringstream in(std::string(reinterpret_cast<const char*>(jpeg.raw()), jpeg.size()));
+    // A4 at 300 DPI
+    return jpeg_downscale_eighths(read_jpeg_head(in), 2480, 3508);
+  };
+
+  ASSERT(eighths(8000, 6000) == 4);
+  ASSERT(eighths(6000, 8000) == 4);
+  ASSERT(eighths(20000, 15000) == 2);
+  ASSERT(eighths(4000, 3000) == 8);
+  ASSERT(eighths(640, 480) == 8);
+  // Unknown height (defined by a later DNL marker)
+  ASSERT(eighths(8000, 0) == 8);
+}
+
+TEST(strip_jpeg_markers)
+{
+  Bytestream jfif {(uint8_t)0xFF, (uint8_t)0xE0, (uint16_t)16, "JFIF", (uint8_t)0, (uint16_t)0x0102,
+                   (uint8_t)1, (uint16_t)300, (uint16_t)300, (uint8_t)0, (uint8_t)0};
+  Bytestream jfxx {(uint8_t)0xFF, (uint8_t)0xE0, (uint16_t)10, "JFXX", (uint8_t)0, "abc"};
+  // Little-endian EXIF with something bulky, and orientation as the second entry
+  Bytestream exif {(uint8_t)0xFF, (uint8_t)0xE1, (uint16_t)46, "Exif", (uint16_t)0, "II",
+                   (uint16_t)0x2a00, (uint32_t)0x08000000, (uint16_t)0x0200,
+                   (uint16_t)0x0f01, (uint16_t)0x0200, (uint32_t)0x04000000, "Acme",
+                   (uint16_t)0x1201, (uint16_t)0x0300, (uint32_t)0x01000000, (uint32_t)0x06000000,
+                   (uint32_t)0};
+  Bytestream xmp {(uint8_t)0xFF, (uint8_t)0xE1, (uint16_t)7, "http:"};
+  Bytestream com {(uint8_t)0xFF, (uint8_t)0xFE, (uint16_t)7, "hello"};
+  Bytestream dqt {(uint8_t)0xFF, (uint8_t)0xDB, (uint16_t)3, (uint8_t)0};
+  Bytestream sof {(uint8_t)0xFF, (uint8_t)0xC0, (uint16_t)11, (uint8_t)8, (uint16_t)1, (uint16_t)1,
+                  (uint8_t)1, (uint8_t)1, (uint8_t)0x11, (uint8_t)0};
+  Bytestream scan {(uint8_t)0xFF, (uint8_t)0xDA, (uint16_t)8, (uint8_t)1, (uint8_t)1, (uint8_t)0,
+                   (uint8_t)0, (uint8_t)63, (uint8_t)0, (uint8_t)0xFF, (uint8_t)0x00, (uint8_t)0x12,
+                   (uint8_t)0xFF, (uint8_t)0xD9};
+
+  Bytestream jpeg;
+  jpeg << (uint8_t)0xFF << (uint8_t)0xD8 << jfif << jfxx << exif << xmp << com << dqt << sof << scan;
+  std::istringstream in(std::string(reinterpret_cast<const char*>(jpeg.raw()), jpeg.size()));
+
+  Bytestream stripped;
+  strip_jpeg_markers(in, [&stripped](Bytestream&& data)
+                         {
+                           stripped << data;
+                           return true;
+                         });
+
+  // Orientation is rewritten as the only entry, in big-endian
+  Bytestream orientation {(uint8_t)0xFF, (uint8_t)0xE1, (uint16_t)34, "Exif", (uint16_t)0, "MM",
+                          (uint16_t)42, (uint32_t)8, (uint16_t)1,
+                          (uint16_t)0x0112, (uint16_t)3, (uint32_t)1, (uint16_t)6, (uint16_t)0,
+                          (uint32_t)0};
+  Bytestream expected;
+  expected << (uint8_t)0xFF << (uint8_t)0xD8 << jfif << orientation << dqt << sof << scan;
+  ASSERT(stripped == expected);
+}
+
+TEST(downscale_jpeg)
+{
+  InBinFile jpegFile("landscape_4x3.jpg");
+  Bytestream original(jpegFile);
+  // An ICC profile that is to be kept, in front of the rest
+  Bytestream icc {(uint8_t)0xFF, (uint8_t)0xE2, (uint16_t)19, "ICC_PROFILE", (uint8_t)0,
+                  (uint8_t)1, (uint8_t)1, "abc"};
+  Bytestream jpeg;
+  jpeg << original.getBytestream(2) << icc << original.getBytestream(original.remaining());
+  std::istringstream in(std::string(reinterpret_cast<const char*>(jpeg.raw()), jpeg.size()));
+
+  Bytestream out;
+  WriteFun writeFun([&out](Bytestream&& data)
+  {
+    out << data;
+    return true;
+  });
+  ASSERT_FALSE(downscale_jpeg(in, writeFun, 4));
+  ASSERT(is_sequential_jpeg(out));
+  ASSERT(out.size() < jpeg.size());
+  ASSERT(std::search(out.raw(), out.raw() + out.size(), icc.raw(), icc.raw() + icc.size())
+         != out.raw() + out.size());
+
+  // A broken image is an error rather than the end of the process
+  std::istringstream garbage("not a jpeg");
+  ASSERT(downscale_jpeg(garbage, writeFun, 4));
+}
+
+TEST(jpeg_to_raster)
+{
+  PrintParameters params;
+  params.format = PrintParameters::PWG;
+  params.colorMode = PrintParameters::Gray8;
+  params.hwResW = 100;
+  params.hwResH = 100;
+
+  Bytestream pwg;
+  WriteFun writeFun([&pwg](Bytestream&& data)
+  {
+    pwg << data;
+    return true;
+  });
+  ASSERT_FALSE(jpeg_to_raster("landscape_4x3.jpg", params, writeFun));
+
+  ASSERT(pwg >>= "RaS2");
+  PwgPgHdr pwgHdr;
+  pwgHdr.decodeFrom(pwg);
+  size_t width = pwgHdr.Width;
+  size_t height = pwgHdr.Height;
+  ASSERT(width == 826);
+  ASSERT(height == 1169);
+
+  Bytestream bmp;
+  raster_to_bmp(bmp, pwg, width, height, 1, 8, false);
+  ASSERT(pwg.atEnd());
+
+  // Black image, fitted to the page width and centered vertically
+  Bytestream white_line(width, 0xff);
+  Bytestream black_line(width, 0x00);
+  size_t top_margin = 0;
+  size_t image_height = 0;
+  size_t bottom_margin = 0;
+  while(bmp.nextBytestream(white_line))
+  {
+    top_margin++;
+  }
+  while(bmp.nextBytestream(black_line))
+  {
+    image_height++;
+  }
+  while(bmp.nextBytestream(white_line))
+  {
+    bottom_margin++;
+  }
+  ASSERT(bmp.atEnd());
+  ASSERT(close_enough(image_height, 620, 1));
+  ASSERT(close_enough(top_margin, bottom_margin, 1));
+
+  // Copies from stdin, which can only be read once
+  std::ifstream jpegFile("landscape_4x3.jpg", std::ios::in | std::ios::binary);
+  std::streambuf* cinBuf = std::cin.rdbuf(jpegFile.rdbuf());
+  params.copies = 2;
+  Bytestream pwg2;
+  WriteFun writeFun2([&pwg2](Bytestream&& data)
+  {
+    pwg2 << data;
+    return true;
+  });
+  Error error = jpeg_to_raster("-", params, writeFun2);
+  std::cin.rdbuf(cinBuf);
+  ASSERT_FALSE(error);
+  ASSERT(pwg2 >>= "RaS2");
+  PwgPgHdr pwgHdr2;
+  pwgHdr2.decodeFrom(pwg2);
+  Bytestream page1 = pwg2.getBytestream(pwg.size() - pwg2.pos());
+  pwgHdr2.decodeFrom(pwg2);
+  ASSERT(pwgHdr2.Height == height);
+  ASSERT(pwg2.getBytestream(page1.size()) == page1);
+  ASSERT(pwg2.atEnd());
+
+  params.format = PrintParameters::PDF;
+  ASSERT(jpeg_to_raster("landscape_4x3.jpg", params, writeFun));
+}
+
+TEST(baselinifier)
+{
+  InBinFile jpegFile("landscape_4x3.jpg");
+  Bytestream jpeg(jpegFile);
+  Bytestream garbage {string("not a jpeg")};
+  Bytestream first;
+  Bytestream failed;
+  Bytestream again;
+
+  // Errors are returned, and the next image converts the same as before
+  Baselinifier baselinifier;
+  ASSERT_FALSE(baselinifier.baselinify(jpeg, first));
+  ASSERT(baselinifier.baselinify(garbage, failed));
+  ASSERT_FALSE(baselinifier.baselinify(jpeg, again));
+  ASSERT(first.size() != 0);
+  ASSERT(again == first);
+}
+
 extern List<std::string> get_addr(Bytestream& bts, std::set<uint16_t> seenReferences={});
 
 TEST(malicious_dns)
@@ -2688,6 +3420,21 @@ TEST(url)
   ASSERT(url.getPath() == "/ipp/print");
   ASSERT(url.toStr() == "ipp://[:BEEF]:631/ipp/print");
 
+  url = "ipp+unix://%2Frun%2Fipp.sock/ipp/print";
+  ASSERT(url.isValid());
+  ASSERT(url.isUnixSocket());
+  ASSERT(url.getScheme() == "ipp+unix");
+  ASSERT(url.getSocketPath() == "/run/ipp.sock");
+  ASSERT(url.getPath() == "/ipp/print");
+  ASSERT(url.toStr() == "ipp+unix://%2Frun%2Fipp.sock/ipp/print");
+  ASSERT(url.localUrl().toStr() == "ipp://localhost/ipp/print");
+  ASSERT(http_url(url) == "http+unix://%2Frun%2Fipp.sock:631/ipp/print");
+  ASSERT(url.localUrl().toStr() == "http://localhost:631/ipp/print");
+
+  url = "ipp://localhost/ipp/print";
+  ASSERT_FALSE(url.isUnixSocket());
+  ASSERT(url.localUrl().toStr() == "ipp://localhost/ipp/print");
+
 }
 
 TEST(with_language)
@@ -2710,3 +3457,348 @@ TEST(with_language)
   // Language is ignored and the actual value appears as-is.
   ASSERT(ippMsg.getJobAttrs().front().at("job-name").get<std::string>() == "fou");
 }
+
+TEST(read_url_list)
+{
+  std::istringstream list("ipp://printer1/ipp/print\n"
+                          "\n"
+                          "# A comment\n"
+                          "  \t\n"
+                          "  ipps://printer2:631/ipp/print \t\n"
+                          "  # Indented comment\n"
+                          "ipp://printer3");
+  List<Url> addrs = read_url_list(list);
+  ASSERT(addrs.size() == 3);
+  ASSERT(addrs.front().toStr() == "ipp://printer1/ipp/print");
+  ASSERT((*std::next(addrs.begin())).toStr() == "ipps://printer2:631/ipp/print");
+  ASSERT(addrs.back().toStr() == "ipp://printer3");
+
+  std::istringstream empty("");
+  ASSERT(read_url_list(empty).empty());
+}
+
+TEST(fleet_read_response)
+{
+  IppFleetPoller::Result result;
+  Bytestream response;
+  ASSERT_FALSE(IppFleetPoller::readResponse(result, CURLE_COULDNT_CONNECT, response, false));
+  ASSERT(result.error == std::string(curl_easy_strerror(CURLE_COULDNT_CONNECT)));
+
+  // Not IPP at all
+  result = IppFleetPoller::Result();
+  response = Bytestream(std::string("<html>Not found</html>"));
+  ASSERT_FALSE(IppFleetPoller::readResponse(result, CURLE_OK, response, false));
+  ASSERT(result.error);
+
+  result = IppFleetPoller::Result();
+  IppAttrs opAttrs {{"status-message", IppAttr(IppTag::TextWithoutLanguage, "client-error-not-found")}};
+  response = IppMsg(0x0406, opAttrs).encode();
+  ASSERT_FALSE(IppFleetPoller::readResponse(result, CURLE_OK, response, false));
+  ASSERT(result.error == std::string("client-error-not-found"));
+
+  // Without a message
+  result = IppFleetPoller::Result();
+  response = IppMsg(0x0500, IppAttrs()).encode();
+  ASSERT_FALSE(IppFleetPoller::readResponse(result, CURLE_OK, response, false));
+  ASSERT(result.error == std::string("unknown"));
+
+  result = IppFleetPoller::Result();
+  IppAttrs printerAttrs {{"printer-state", IppAttr(IppTag::Enum, 3)}};
+  response = IppMsg(0, IppAttrs(), IppAttrs(), printerAttrs).encode();
+  ASSERT(IppFleetPoller::readResponse(result, CURLE_OK, response, false));
+  ASSERT_FALSE(result.error);
+  ASSERT(result.printerAttrs == printerAttrs);
+
+  IppAttrs jobAttrs {{"job-id", IppAttr(IppTag::Integer, 17)}};
+  response = IppMsg(0, IppAttrs(), jobAttrs).encode();
+  ASSERT(IppFleetPoller::readResponse(result, CURLE_OK, response, true));
+  ASSERT_FALSE(result.error);
+  ASSERT(result.printerAttrs == printerAttrs);
+  ASSERT(result.jobs == List<IppAttrs> {jobAttrs});
+}
+
+TEST(attribute_cache)
+{
+  IppDateTime changed {2024, 5, 6, 7, 8, 9, 3, '-', 4, 30};
+  IppAttrs attrs {{"printer-config-change-time", IppAttr(IppTag::Integer, 1234)},
+                  {"printer-config-change-date-time", IppAttr(IppTag::DateTime, changed)},
+                  {"printer-uuid", IppAttr(IppTag::Uri, "urn:uuid:6d7ebcd6-5d83-4d8b-9ee6-2c8e1b1c4b1f")},
+                  {"printer-resolution-supported",
+                   IppAttr(IppTag::Resolution, IppOneSetOf {IppResolution {300, 300, IppResolution::DPI},
+                                                            IppResolution {600, 600, IppResolution::DPI}})},
+                  {"copies-supported", IppAttr(IppTag::IntegerRange, IppIntRange {1, 99})},
+                  {"media-col-default",
+                   IppAttr(IppTag::BeginCollection,
+                           IppCollection {{"media-type", IppAttr(IppTag::Keyword, "stationery")}})},
+                  {"sides-supported", IppAttr(IppTag::Keyword, IppOneSetOf {"one-sided", "two-sided-long-edge"})},
+                  {"printer-state", IppAttr(IppTag::Enum, 3)},
+                  {"printer-alert", IppAttr(IppTag::OctetStringUnknown, "code=mediaLow")},
+                  {"marker-levels", IppAttr(IppTag::Integer, IppOneSetOf {80, 20})}};
+
+  std::filesystem::path path = std::filesystem::temp_directory_path() / "ppm2pwg_test_cache" / "printer";
+  std::filesystem::remove_all(path.parent_path());
+  IppAttrs loaded;
+  ASSERT_FALSE(IppPrinter::loadCache(path, loaded));
+
+  ASSERT(IppPrinter::saveCache(path, attrs));
+  ASSERT(IppPrinter::loadCache(path, loaded));
+  ASSERT(loaded == attrs);
+  ASSERT(loaded.get<IppDateTime>("printer-config-change-date-time") == changed);
+
+  // Without printer-config-change-time there is no telling if it is still valid
+  IppAttrs unversioned = attrs;
+  unversioned.erase("printer-config-change-time");
+  std::filesystem::path path2 = path.parent_path() / "printer2";
+  ASSERT_FALSE(IppPrinter::saveCache(path2, unversioned));
+  ASSERT_FALSE(std::filesystem::exists(path2));
+  std::filesystem::remove_all(path.parent_path());
+
+  IppOneSetOf requested = IppPrinter::cacheValidationAttributes();
+  for(const char* name : {"printer-config-change-time", "printer-uuid", "ipp-versions-supported",
+                          "printer-state", "marker-levels", "printer-alert", "queued-job-count"})
+  {
+    ASSERT(requested.contains(name));
+  }
+
+  // Unchanged configuration, volatile attributes taken from the printer
+  IppAttrs current {{"printer-config-change-time", IppAttr(IppTag::Integer, 1234)},
+                    {"printer-uuid", attrs.at("printer-uuid")},
+                    {"printer-state", IppAttr(IppTag::Enum, 4)},
+                    {"marker-levels", IppAttr(IppTag::Integer, IppOneSetOf {70, 10})},
+                    {"queued-job-count", IppAttr(IppTag::Integer, 2)}};
+  std::optional<IppAttrs> valid = IppPrinter::validateCache(attrs, current);
+  ASSERT(valid);
+  ASSERT(valid->get<int>("printer-state") == 4);
+  ASSERT(valid->getList<int>("marker-levels") == List<int>({70, 10}));
+  ASSERT(valid->get<int>("queued-job-count") == 2);
+  ASSERT_FALSE(valid->has("printer-alert"));
+  ASSERT(valid->getList<std::string>("sides-supported") == attrs.getList<std::string>("sides-supported"));
+
+  // Changed configuration, or a different printer at the same address
+  IppAttrs reconfigured = current;
+  reconfigured.set("printer-config-change-time", IppAttr(IppTag::Integer, 1235));
+  ASSERT_FALSE(IppPrinter::validateCache(attrs, reconfigured));
+  IppAttrs replaced = current;
+  replaced.set("printer-uuid", IppAttr(IppTag::Uri, "urn:uuid:00000000-0000-0000-0000-000000000000"));
+  ASSERT_FALSE(IppPrinter::validateCache(attrs, replaced));
+  IppAttrs unknown = current;
+  unknown.erase("printer-config-change-time");
+  ASSERT_FALSE(IppPrinter::validateCache(attrs, unknown));
+}
+
+TEST(requested_attributes)
+{
+  ASSERT(IppPrinter::requestedAttributes(IppPrinter::FullProfile).empty());
+  for(IppPrinter::Profile profile : {IppPrinter::StatusProfile,
+                                     IppPrinter::JobsProfile,
+                                     IppPrinter::IdentifyProfile})
+  {
+    // Needed to pick the version for any requests that follow
+    ASSERT(IppPrinter::requestedAttributes(profile).contains("ipp-versions-supported"));
+  }
+  IppOneSetOf status = IppPrinter::requestedAttributes(IppPrinter::StatusProfile);
+  ASSERT(status.contains("printer-state"));
+  ASSERT(status.contains("printer-state-reasons"));
+  ASSERT(status.contains("printer-state-message"));
+  ASSERT(IppPrinter::requestedAttributes(IppPrinter::IdentifyProfile)
+         .contains("identify-actions-supported"));
+
+  IppOneSetOf jobInfo = IppPrinter::JobInfo::requestedAttributes();
+  for(const char* name : {"job-id", "job-name", "job-state", "job-printer-state-message"})
+  {
+    ASSERT(jobInfo.contains(name));
+  }
+}
+
+TEST(holding_writer)
+{
+  Bytestream out;
+  WriteFun writeFun([&out](Bytestream&& data)
+  {
+    out << data;
+    return true;
+  });
+  bool ready = false;
+  bool begun = false;
+  auto isReady = [&ready]()
+  {
+    return ready;
+  };
+  auto begin = [&begun]()
+  {
+    begun = true;
+    return true;
+  };
+
+  // Held while the request is not known, up to the limit
+  size_t size = IppPrinter::MaxHeldBytes - 1;
+  HoldingWriter holder(isReady, begin, writeFun, IppPrinter::MaxHeldBytes);
+  ASSERT(holder.write(Bytestream(size, 0x11)));
+  ASSERT(holder.write(Bytestream()));
+  ASSERT_FALSE(holder.started());
+  ASSERT_FALSE(begun);
+  ASSERT(holder.heldBytes() == size);
+  ASSERT(out.size() == 0);
+  // ...where it starts, and writes what was held in order
+  size = 1;
+  ASSERT(holder.write(Bytestream(size, 0x22)));
+  ASSERT(holder.started());
+  ASSERT(begun);
+  ASSERT(holder.heldBytes() == 0);
+  ASSERT(out.size() == IppPrinter::MaxHeldBytes);
+  ASSERT(out.raw()[0] == 0x11);
+  ASSERT(out.raw()[IppPrinter::MaxHeldBytes - 1] == 0x22);
+  // ...and then writes straight on
+  size = 3;
+  ASSERT(holder.write(Bytestream(size, 0x33)));
+  ASSERT(out.size() == IppPrinter::MaxHeldBytes + 3);
+  ASSERT(holder.start());
+
+  // Starts as soon as the request is known
+  out = Bytestream();
+  size = 4;
+  HoldingWriter readyHolder(isReady, begin, writeFun, 100);
+  ASSERT(readyHolder.write(Bytestream(size, 0x11)));
+  ASSERT_FALSE(readyHolder.started());
+  ready = true;
+  ASSERT(readyHolder.write(Bytestream(size, 0x22)));
+  ASSERT(readyHolder.started());
+  ASSERT(out.size() == 8);
+
+  // Held past the limit while it can not start, as for a compression trial
+  out = Bytestream();
+  size = 200;
+  HoldingWriter sampling(isReady, begin, writeFun, 100);
+  ASSERT(sampling.write(Bytestream(size, 0x11), false));
+  ASSERT_FALSE(sampling.started());
+  ASSERT(sampling.heldBytes() == 200);
+  ASSERT(sampling.write(Bytestream(size, 0x22)));
+  ASSERT(sampling.started());
+  ASSERT(out.size() == 400);
+
+  // Create-Job failing while data is held: it is discarded, and writing fails from then on
+  std::promise<IppMsg> createJob;
+  std::future<IppMsg> msgFuture = createJob.get_future();
+  std::string error;
+  auto failingBegin = [&msgFuture, &error]()
+  {
+    try
+    {
+      msgFuture.get();
+    }
+    catch(const std::exception& e)
+    {
+      error = e.what();
+      return false;
+    }
+    return true;
+  };
+  auto createJobDone = [&msgFuture]()
+  {
+    return msgFuture.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+  };
+  out = Bytestream();
+  size = 10;
+  HoldingWriter failing(createJobDone, failingBegin, writeFun, 100);
+  ASSERT(failing.write(Bytestream(size, 0x11)));
+  ASSERT_FALSE(failing.started());
+  createJob.set_exception(std::make_exception_ptr(std::runtime_error("Create job failed")));
+  ASSERT_FALSE(failing.write(Bytestream(size, 0x22)));
+  ASSERT(failing.started());
+  ASSERT(error == "Create job failed");
+  ASSERT(failing.heldBytes() == 0);
+  ASSERT_FALSE(failing.write(Bytestream(size, 0x33)));
+  ASSERT_FALSE(failing.start());
+  ASSERT(out.size() == 0);
+}
+
+class StatsPoster : public CurlIppPosterBase
+{
+public:
+  StatsPoster() : CurlIppPosterBase(Url("ipp://localhost/ipp/print"))
+  {}
+  // As when cURL is done
+  void finish()
+  {
+    finished();
+  }
+};
+
+TEST(upload_stats)
+{
+  CurlIppPosterBase::UploadStats stats;
+  ASSERT(stats.ratio() == 1.0);
+  ASSERT(stats.rate() == 0.0);
+
+  stats.bytesIn = 4000;
+  stats.bytesOut = 1000;
+  stats.elapsed = std::chrono::milliseconds(500);
+  ASSERT(stats.ratio() == 0.25);
+  ASSERT(stats.rate() == 2000.0);
+
+  // Fed and drained directly, with no transfer running
+  char buf[600];
+  StatsPoster poster;
+  size_t size = 1000;
+  ASSERT(poster.write(Bytestream(size, 0x55)));
+  ASSERT(poster.requestWrite(buf, sizeof(buf)) == 600);
+  ASSERT(poster.requestWrite(buf, sizeof(buf)) == 400);
+  stats = poster.stats();
+  ASSERT(stats.bytesIn == 1000);
+  ASSERT(stats.bytesOut == 1000);
+  poster.await();
+  ASSERT(poster.requestWrite(buf, sizeof(buf)) == 0);
+  poster.finish();
+  ASSERT(poster.stats().elapsed.count() > 0);
+
+  // A write over budget waits for the reader, and the reader waits for writes
+  StatsPoster blocked;
+  blocked.setBufferBudget(100);
+  size = 80;
+  ASSERT(blocked.write(Bytestream(size, 1)));
+  std::atomic<bool> writing = false;
+  LThread writer;
+  writer.run([&blocked, &writing, size]()
+  {
+    writing = true;
+    blocked.write(Bytestream(size, 2));
+  });
+  while(!writing)
+  {
+    std::this_thread::yield();
+  }
+  // The second write can't get through before the first is read
+  ASSERT(blocked.stats().bytesIn == 80);
+  ASSERT(blocked.requestWrite(buf, sizeof(buf)) == 80);
+  // ...and here the reader waits for it
+  ASSERT(blocked.requestWrite(buf, sizeof(buf)) == 80);
+  writer.await();
+  LThread closer;
+  closer.run([&blocked]()
+  {
+    blocked.await();
+  });
+  ASSERT(blocked.requestWrite(buf, sizeof(buf)) == 0);
+  closer.await();
+  stats = blocked.stats();
+  ASSERT(stats.bytesIn == 160);
+  ASSERT(stats.bytesOut == 160);
+  ASSERT(stats.writeBlocked.count() > 0);
+  ASSERT(stats.waitedForData.count() > 0);
+
+  // Counted as written, and as sent after compression
+  StatsPoster compressed;
+  compressed.setCompression(CurlIppPosterBase::Deflate);
+  size = 100000;
+  ASSERT(compressed.write(Bytestream(size, 0)));
+  compressed.await();
+  size_t sent = 0;
+  while(size_t bytes = compressed.requestWrite(buf, sizeof(buf)))
+  {
+    sent += bytes;
+  }
+  stats = compressed.stats();
+  ASSERT(stats.bytesIn == 100000);
+  ASSERT(stats.bytesOut == sent);
+  ASSERT(stats.ratio() < 0.1);
+}
@@ -1,27 +1,141 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <iomanip>
 #include <iostream>
+#include <vector>
 
 #include "argget.h"
 #include "baselinify.h"
 #include "binfile.h"
+#include "list.h"
+#include "stringutils.h"
+#include "workerpool.h"
+
+namespace fs = std::filesystem;
 
 inline void print_error(const std::string& hint, const std::string& argHelp)
 {
   std::cerr << hint << std::endl << std::endl << argHelp << std::endl;
 }
 
+struct FilePair
+{
+  std::string in;
+  std::string out;
+};
+
+// One pair per line, with the input and output file names separated by a tab
+Error read_list(const std::string& listFileName, std::vector<FilePair>& pairs)
+{
+  InBinFile listFile(listFileName);
+  if(!listFile)
+  {
+    return Error("Failed to open list");
+  }
+  std::string line;
+  size_t lineNo = 0;
+  while(std::getline(*listFile, line))
+  {
+    lineNo++;
+    if(line.empty())
+    {
+      continue;
+    }
+    List<std::string> names = split_string(line, "\t");
+    if(names.size() != 2 || names.front().empty() || names.back().empty())
+    {
+      return Error("Bad line " + std::to_string(lineNo) + " in list");
+    }
+    pairs.push_back({names.front(), names.back()});
+  }
+  return Error();
+}
+
+// All .jpg and .jpeg files in inDir, written with the same names to outDir
+Error list_directory(const std::string& inDir, const std::string& outDir, std::vector<FilePair>& pairs)
+{
+  std::error_code ec;
+  if(!fs::is_directory(inDir, ec))
+  {
+    return Error("Input is not a directory");
+  }
+  fs::create_directories(outDir, ec);
+  if(!fs::is_directory(outDir, ec))
+  {
+    return Error("Failed to create output directory");
+  }
+  if(fs::equivalent(inDir, outDir, ec))
+  {
+    return Error("Input and output directories must differ");
+  }
+  for(const fs::directory_entry& entry : fs::directory_iterator(inDir, ec))
+  {
+    std::string extension = entry.path().extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    if(entry.is_regular_file(ec) && (extension == ".jpg" || extension == ".jpeg"))
+    {
+      pairs.push_back({entry.path().string(), (fs::path(outDir) / entry.path().filename()).string()});
+    }
+  }
+  if(ec)
+  {
+    return Error("Failed to list input directory");
+  }
+  std::sort(pairs.begin(), pairs.end(), [](const FilePair& a, const FilePair& b){return a.in < b.in;});
+  return Error();
+}
+
+Error convert_file(Baselinifier& baselinifier, const FilePair& pair)
+{
+  InBinFile inFile(pair.in);
+  if(!inFile)
+  {
+    return Error("Failed to open input");
+  }
+
+  BufferedOutFile outFile(pair.out);
+  if(!outFile)
+  {
+    return Error("Failed to open output");
+  }
+
+  Error error = baselinifier.baselinify(inFile, [&outFile](Bytestream&& data)
+                                        {
+                                          return outFile.write(data);
+                                        });
+  if(!error && !outFile.flush())
+  {
+    error = "Failed to write output";
+  }
+  return error;
+}
+
 int main(int argc, char** argv)
 {
   bool help = false;
+  bool stripMarkers = false;
+  int maxMemory = 0;
+  bool directory = false;
+  int jobs = 1;
 
   std::string inFileName;
   std::string outFileName;
+  std::string listFileName;
 
   SwitchArg<bool> helpOpt(help, {"-h", "--help"}, "Print this help text");
+  SwitchArg<bool> stripMarkersOpt(stripMarkers, {"-s", "--strip-markers"}, "Drop thumbnails and other metadata not needed for printing");
+  SwitchArg<int> maxMemoryOpt(maxMemory, {"-m", "--max-memory"}, "Memory limit for libjpeg (in MiB), if it has a backing store");
+  SwitchArg<bool> directoryOpt(directory, {"-d", "--directory"}, "Convert all .jpg/.jpeg files in the in-file directory into the out-file directory");
+  SwitchArg<std::string> listOpt(listFileName, {"-l", "--list"}, "Convert the in and out file pairs in this file, one tab-separated pair per line");
+  SwitchArg<int> jobsOpt(jobs, {"-j", "--jobs"}, "Number of files to convert in parallel");
 
-  PosArg inArg(inFileName, "in-file");
-  PosArg outArg(outFileName, "out-file prefix");
+  PosArg inArg(inFileName, "in-file", true);
+  PosArg outArg(outFileName, "out-file", true);
 
-  ArgGet args({&helpOpt}, {&inArg, &outArg},
+  ArgGet args({&helpOpt, &stripMarkersOpt, &maxMemoryOpt, &directoryOpt, &listOpt, &jobsOpt},
+              {&inArg, &outArg},
               "Use \"-\" as filename for stdin/stdout.");
 
   bool correctArgs = args.get_args(argc, argv);
@@ -36,19 +150,96 @@ int main(int argc, char** argv)
     return 1;
   }
 
-  InBinFile inFile(argv[1]);
-  if(!inFile)
+  if(maxMemory < 0)
   {
-    std::cerr << "Failed to open input" << std::endl;
+    print_error("Memory limit can not be negative", args.argHelp());
     return 1;
   }
 
-  OutBinFile outFile(argv[2]);
+  if(jobs < 1)
+  {
+    print_error("Number of jobs must be at least 1", args.argHelp());
+    return 1;
+  }
 
-  Bytestream inBts(inFile);
-  Bytestream outBts;
+  bool batch = directory || listOpt.isSet();
+  if(listOpt.isSet() ? (directory || inArg.isSet()) : !outArg.isSet())
+  {
+    print_error("Give either an in-file and out-file, or a list", args.argHelp());
+    return 1;
+  }
 
-  baselinify(inBts, outBts);
+  std::vector<FilePair> pairs;
+  Error listError;
+  if(listOpt.isSet())
+  {
+    listError = read_list(listFileName, pairs);
+  }
+  else if(directory)
+  {
+    listError = list_directory(inFileName, outFileName, pairs);
+  }
+  else
+  {
+    pairs.push_back({inFileName, outFileName});
+  }
+  if(listError)
+  {
+    std::cerr << *listError << std::endl;
+    return 1;
+  }
+
+  WorkerPool pool(pairs.size());
+  std::atomic<size_t> bytesIn = 0;
+
+  // Each worker keeps its own libjpeg contexts for all the files it converts
+  auto worker = [&]()
+  {
+    Baselinifier baselinifier(stripMarkers, static_cast<size_t>(maxMemory) * 1024 * 1024);
+    for(size_t i = 0; pool.next(i);)
+    {
+      const FilePair& pair = pairs[i];
+      Error error = convert_file(baselinifier, pair);
+      if(error)
+      {
+        std::error_code ec;
+        if(batch)
+        {
+          // Don't leave half-written files behind
+          fs::remove(pair.out, ec);
+        }
+        pool.addError(batch ? pair.in + ": " + *error : *error);
+      }
+      else if(batch)
+      {
+        std::error_code ec;
+        uintmax_t size = fs::file_size(pair.in, ec);
+        bytesIn += ec ? 0 : size;
+      }
+    }
+  };
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+  pool.run(jobs, worker);
+
+  const List<std::string>& errors = pool.errors();
+  for(const std::string& error : errors)
+  {
+    std::cerr << error << std::endl;
+  }
+
+  if(batch)
+  {
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    double seconds = std::max(elapsed.count(), 0.001);
+    size_t converted = pairs.size() - errors.size();
+    double mib = bytesIn / (1024.0 * 1024.0);
+    std::cerr << std::fixed << std::setprecision(1)
+              << "Converted " << converted << " of " << pairs.size() << " files, "
+              << mib << " MiB in " << seconds << " s ("
+              << converted / seconds << " files/s, " << mib / seconds << " MiB/s)" << std::endl;
+  }
 
-  outFile << outBts;
+  return errors.empty() ? 0 : 1;
 }
@@ -1,11 +1,15 @@
 #include <filesystem>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
 #include <regex>
+#include <sstream>
 
 #include <poppler.h>
 #include <poppler-document.h>
 
 #include "argget.h"
+#include "ippfleet.h"
 #include "ippprinter.h"
 #include "list.h"
 #include "log.h"
@@ -112,6 +116,37 @@ std::ostream& operator<<(std::ostream& os, const List<IppPrinter::JobInfo>& jobI
   return os;
 }
 
+std::ostream& operator<<(std::ostream& os, const CurlIppPosterBase::UploadStats& stats)
+{
+  constexpr double MiB = 1024 * 1024;
+  // Formatted aside, so os keeps its own precision
+  std::stringstream ss;
+  ss << std::fixed << std::setprecision(2)
+     << "Uploaded " << stats.bytesIn / MiB << " MiB as " << stats.bytesOut / MiB << " MiB"
+     << " (ratio " << stats.ratio() << ") in " << stats.elapsed.count() << " s, "
+     << stats.rate() / MiB << " MiB/s" << std::endl
+     << "Converter blocked: " << stats.writeBlocked.count() << " s, "
+     << "upload waited for data: " << stats.waitedForData.count() << " s, "
+     << "for compression: " << stats.waitedForCompression.count() << " s";
+  os << ss.str();
+  return os;
+}
+
+std::string state_name(int state)
+{
+  switch(state)
+  {
+    case 3:
+      return "idle";
+    case 4:
+      return "processing";
+    case 5:
+      return "stopped";
+    default:
+      return "unknown";
+  }
+}
+
 template <typename T>
 void do_print(const std::string& title, const T& value)
 {
@@ -164,6 +199,7 @@ int main(int argc, char** argv)
   bool help = false;
   bool verbose = false;
   bool verifySsl = false;
+  bool noCache = false;
   std::string pinnedPublicKey;
   bool force = false;
   bool oneStage = false;
@@ -195,19 +231,27 @@ int main(int argc, char** argv)
   int rightMargin;
 
   bool antiAlias;
+  bool downscaleJpeg;
+  bool stripJpegMarkers;
   bool printJobId = false;
   bool save = false;
 
   int id;
 
+  bool withJobs = false;
+  int timeout = IppFleetPoller::DefaultTimeoutMs;
+  int maxConcurrent = IppFleetPoller::DefaultMaxConcurrent;
+
   std::string addrString;
   std::string attrs;
   std::string inFile;
+  std::string listFile;
 
   SwitchArg<bool> helpOpt(help, {"-h", "--help"}, "Print this help text");
   SwitchArg<bool> verboseOpt(verbose, {"-v", "--verbose"}, "Be verbose, print headers and progress");
   SwitchArg<bool> verifySslOpt(verifySsl, {"--verify-ssl"}, "Verify the printer's SSL cerificate");
   SwitchArg<std::string> pinnedPublicKeyOpt(pinnedPublicKey, {"--ssl-pubkey"}, "Require a certain SSL public key to match");
+  SwitchArg<bool> noCacheOpt(noCache, {"--no-cache"}, "Always get all printer attributes, rather than reuse cached ones");
   SwitchArg<bool> forceOpt(force, {"-f", "--force"}, "Force use of unsupported options");
   SwitchArg<bool> oneStageOpt(oneStage, {"--one-stage"}, "Force use of one-stage print job");
 
@@ -248,16 +292,23 @@ int main(int argc, char** argv)
   SwitchArg<int> rightMarginOpt(rightMargin, {"-rm", "--right-margin"}, "Right margin (as per IPP)");
 
   SwitchArg<bool> antiAliasOpt(antiAlias, {"-aa", "--antialias"}, "Enable antialiasing in rasterization");
+  SwitchArg<bool> stripJpegMarkersOpt(stripJpegMarkers, {"--strip-jpeg-markers"}, "Drop JPEG thumbnails and metadata not needed for printing");
+  SwitchArg<bool> downscaleJpegOpt(downscaleJpeg, {"--downscale-jpeg"}, "Shrink JPEGs larger than the paper size needs at the print resolution");
   SwitchArg<bool> printJobIdOpt(printJobId, {"--print-job-id"}, "Print job id on successful submission");
   SwitchArg<bool> saveOpt(save, {"--save"}, "Save options as local defaults for future jobs");
 
   SwitchArg<int> idOpt(id, {"--id"}, "Id of print job.");
 
+  SwitchArg<bool> withJobsOpt(withJobs, {"--with-jobs"}, "Also get the jobs of each printer");
+  SwitchArg<int> timeoutOpt(timeout, {"--timeout"}, "Time limit per request, in milliseconds");
+  SwitchArg<int> maxConcurrentOpt(maxConcurrent, {"--max-concurrent"}, "Number of printers to poll at a time");
+
   PosArg addrArg(addrString, "printer address");
   PosArg attrsArg(attrs, "name=value[,name=value]");
   PosArg pdfArg(inFile, "input file");
+  PosArg listArg(listFile, "address list");
 
-  SubArgGet args({&helpOpt, &verboseOpt, &verifySslOpt, &pinnedPublicKeyOpt},
+  SubArgGet args({&helpOpt, &verboseOpt, &verifySslOpt, &pinnedPublicKeyOpt, &noCacheOpt},
                  {{"info", {{}, {&addrArg}}},
                   {"options", {{}, {&addrArg}}},
                   {"identify", {{}, {&addrArg}}},
@@ -265,6 +316,9 @@ int main(int argc, char** argv)
                   {"set-attrs", {{}, {&addrArg, &attrsArg}}},
                   {"get-jobs", {{}, {&addrArg}}},
                   {"cancel-job", {{&idOpt}, {&addrArg}}},
+                  {"poll", {{&withJobsOpt, &timeoutOpt, &maxConcurrentOpt}, {&listArg},
+                            "Polls the state of many printers at once.\n"
+                            "The list has one printer address per line, use \"-\" for stdin."}},
                   {"print", {{&forceOpt, &oneStageOpt,
                               &pagesOpt, &copiesOpt, &collatedCopiesOpt, &numberUpOpt, &paperSizeOpt,
                               &resolutionOpt, &resolutionXOpt, &resolutionYOpt,
@@ -272,7 +326,7 @@ int main(int argc, char** argv)
                               &formatOpt, &mimeTypeOpt,
                               &mediaTypeOpt, &mediaSourceOpt, &outputBinOpt, &finishingsOpt,
                               &marginOpt, &topMarginOpt, &bottomMarginOpt, &leftMarginOpt, &rightMarginOpt,
-                              &antiAliasOpt, &printJobIdOpt, &saveOpt},
+                              &antiAliasOpt, &downscaleJpegOpt, &stripJpegMarkersOpt, &printJobIdOpt, &saveOpt},
                              {&addrArg, &pdfArg},
                              "Use \"-\" as filename for stdin.\n"
                              "Use the 'options' sub-command to get valid options for your particular printer."}}});
@@ -294,23 +348,84 @@ int main(int argc, char** argv)
     LogController::instance().enable(LogController::Debug);
   }
 
+  CurlRequester::setUserAgent("ppm2pwg-ippclient");
+
+  if(args.subCommand() == "poll")
+  {
+    if(timeout <= 0 || maxConcurrent <= 0)
+    {
+      print_error("Timeout and max concurrent must be positive", args.argHelp(args.subCommand()));
+      return 1;
+    }
+    std::ifstream listStream;
+    if(listFile != "-")
+    {
+      listStream.open(listFile);
+      if(!listStream)
+      {
+        std::cerr << "Failed to open address list" << std::endl;
+        return 1;
+      }
+    }
+    List<Url> addrs = read_url_list(listFile == "-" ? std::cin : listStream);
+
+    IppFleetPoller poller(SslConfig(verifySsl, pinnedPublicKey));
+    poller.setGetJobs(withJobs);
+    poller.setTimeout(timeout);
+    poller.setMaxConcurrent(maxConcurrent);
+
+    size_t failed = 0;
+    poller.poll(addrs, [&failed, withJobs](IppFleetPoller::Result&& result)
+    {
+      std::cout << result.addr.toStr() << ": ";
+      if(result.error)
+      {
+        failed++;
+        std::cout << "error: " << result.error.value() << std::endl;
+        return;
+      }
+      IppPrinter printer(result.printerAttrs);
+      std::cout << state_name(printer.state());
+      if(!printer.stateMessage().empty())
+      {
+        std::cout << " (" << printer.stateMessage() << ")";
+      }
+      std::cout << ", " << join_string(printer.stateReasons(), ", ");
+      if(withJobs)
+      {
+        std::cout << ", " << result.jobs.size() << " jobs";
+      }
+      std::cout << std::endl;
+    });
+    return failed == 0 ? 0 : 1;
+  }
+
   Url addr(addrString);
 
-  if(verifySslOpt.isSet() && addr.getScheme() != "ipps")
+  if(verifySslOpt.isSet() && addr.localUrl().getScheme() != "ipps")
   {
     std::cerr << "--verify-ssl given, but address is not ipps." << std::endl;
     return 1;
   }
 
-  if(pinnedPublicKeyOpt.isSet() && addr.getScheme() != "ipps")
+  if(pinnedPublicKeyOpt.isSet() && addr.localUrl().getScheme() != "ipps")
   {
     std::cerr << "--ssl-pubkey given, but address is not ipps." << std::endl;
     return 1;
   }
 
-  CurlRequester::setUserAgent("ppm2pwg-ippclient");
+  // Most sub-commands need only a few attributes
+  IppPrinter::Profile profile = IppPrinter::FullProfile;
+  if(args.subCommand() == "identify")
+  {
+    profile = IppPrinter::IdentifyProfile;
+  }
+  else if(args.subCommand() == "get-jobs" || args.subCommand() == "cancel-job")
+  {
+    profile = IppPrinter::JobsProfile;
+  }
 
-  IppPrinter printer(addr, SslConfig(verifySsl, pinnedPublicKey));
+  IppPrinter printer(addr, SslConfig(verifySsl, pinnedPublicKey), !noCache, profile);
   Error error = printer.error();
   if(error)
   {
@@ -438,6 +553,16 @@ int main(int argc, char** argv)
       job.printParams.antiAlias = antiAlias;
     }
 
+    if(downscaleJpegOpt.isSet())
+    {
+      job.printParams.downscaleJpeg = downscaleJpeg;
+    }
+
+    if(stripJpegMarkersOpt.isSet())
+    {
+      job.printParams.stripJpegMarkers = stripJpegMarkers;
+    }
+
     if(!mimeTypeOpt.isSet())
     {
       if(inFile != "-")
@@ -567,6 +692,11 @@ int main(int argc, char** argv)
 
     printer.printJobId(printJobId);
     error = printer.runJob(job, inFile, mimeType, nPages, progressFun);
+    // Not for file:// printers, or jobs that failed before uploading
+    if(verbose && printer.uploadStats())
+    {
+      std::cerr << *printer.uploadStats() << std::endl;
+    }
 
     if(error)
     {
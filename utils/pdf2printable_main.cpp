@@ -196,12 +196,16 @@ int main(int argc, char** argv)
     }
   }
 
-  OutBinFile outFile(outFileName);
+  BufferedOutFile outFile(outFileName);
+  if(!outFile)
+  {
+    std::cerr << "Failed to open output" << std::endl;
+    return 1;
+  }
 
   WriteFun writeFun([&outFile](Bytestream&& data) -> bool
            {
-             outFile << data;
-             return outFile->exceptions() == std::ostream::goodbit;
+             return outFile.write(data);
            });
 
   Error error;
@@ -212,6 +216,11 @@ int main(int argc, char** argv)
               });
   error = pdf_to_printable(inFileName, params, writeFun, progressFun);
 
+  if(!error && !outFile.flush())
+  {
+    error = Error("Failed to write output");
+  }
+
   if(error)
   {
     std::cerr << "Conversion failed: " << error.value() << std::endl;
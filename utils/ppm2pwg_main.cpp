@@ -1,14 +1,21 @@
+#include <atomic>
 #include <cstring>
+#include <future>
 #include <iostream>
 #include <string>
 #include <limits>
+#include <optional>
 
 #include "argget.h"
 #include "binfile.h"
+#include "boundedqueue.h"
 #include "bytestream.h"
+#include "list.h"
 #include "log.h"
+#include "lthread.h"
 #include "mediaposition.h"
 #include "ppm2pwg.h"
+#include "resample.h"
 #include "stringutils.h"
 
 inline void print_error(const std::string& hint, const std::string& argHelp)
@@ -28,6 +35,146 @@ inline void ignore_comments(std::istream& in)
   }
 }
 
+// Raster data of one page, either pointing into a mapped file or owned
+struct PageData
+{
+  const uint8_t* mapped = nullptr;
+  Bytestream owned;
+
+  const uint8_t* raw()
+  {
+    return mapped != nullptr ? mapped : owned.raw();
+  }
+};
+
+// Reads pages from a stream, holding one page at a time
+class StreamPpmReader
+{
+public:
+  StreamPpmReader(InBinFile& in) : _in(in)
+  {}
+
+  bool atEnd()
+  {
+    _in->peek(); // maybe trigger eof
+    return _in->eof();
+  }
+
+  std::string token()
+  {
+    ignore_comments(_in);
+    std::string tok;
+    _in >> tok;
+    return tok;
+  }
+
+  void endHeader()
+  {
+    ignore_comments(_in);
+  }
+
+  bool page(size_t size, PageData& data)
+  {
+    data.owned = Bytestream(_in, size);
+    return data.owned.size() == size;
+  }
+
+private:
+  InBinFile& _in;
+};
+
+// Parses pages in place from a memory mapped file, without copying
+class MappedPpmReader
+{
+public:
+  MappedPpmReader(const MappedInFile& in) : _data(in.data()), _size(in.size())
+  {}
+
+  bool atEnd() const
+  {
+    return _pos >= _size;
+  }
+
+  std::string token()
+  {
+    ignoreComments();
+    while(_pos < _size && isspace(_data[_pos]))
+    {
+      _pos++;
+    }
+    size_t start = _pos;
+    while(_pos < _size && !isspace(_data[_pos]))
+    {
+      _pos++;
+    }
+    return std::string(reinterpret_cast<const char*>(_data + start), _pos - start);
+  }
+
+  void endHeader()
+  {
+    ignoreComments();
+  }
+
+  bool page(size_t size, PageData& data)
+  {
+    if(size > _size - _pos)
+    {
+      return false;
+    }
+    data.mapped = _data + _pos;
+    _pos += size;
+    return true;
+  }
+
+private:
+  // Same as ignore_comments, for the mapped data
+  void ignoreComments()
+  {
+    if(_pos < _size && _data[_pos] == '\n')
+    {
+      _pos++;
+    }
+    while(_pos < _size && _data[_pos] == '#')
+    {
+      const void* eol = memchr(_data + _pos, '\n', _size - _pos);
+      _pos = eol != nullptr ? (static_cast<const uint8_t*>(eol) - _data) + 1 : _size;
+    }
+  }
+
+  const uint8_t* _data;
+  size_t _size;
+  size_t _pos = 0;
+};
+
+struct EncodeJob
+{
+  size_t page;
+  PrintParameters params;
+  PageData data;
+  std::promise<Bytestream> result;
+};
+
+Bytestream encode_page(size_t page, PrintParameters params, PageData& data,
+                       size_t xFactor, size_t yFactor, LineResampler::Mode resampleMode)
+{
+  const uint8_t* bmp = data.raw();
+  Bytestream smallBts;
+  if(xFactor != 1 || yFactor != 1)
+  {
+    downsample_bitmap(smallBts, bmp, params.paperSizeW, params.paperSizeH,
+                      params.getNumberOfColors(), params.getBitsPerColor(),
+                      xFactor, yFactor, resampleMode);
+    params.paperSizeW = size_t(params.paperSizeW) / xFactor;
+    params.paperSizeH = size_t(params.paperSizeH) / yFactor;
+    bmp = smallBts.raw();
+    DBG(<< "Downsampled to: " << params.paperSizeW << "x" << params.paperSizeH);
+  }
+
+  Bytestream outBts;
+  bmp_to_pwg(bmp, outBts, page, params);
+  return outBts;
+}
+
 int main(int argc, char** argv)
 {
   PrintParameters params;
@@ -39,6 +186,9 @@ int main(int argc, char** argv)
   int hwRes = 0;
   int hwResX = 0;
   int hwResY = 0;
+  int targetRes = 0;
+  bool decimate = false;
+  int jobs = 1;
   bool duplex = false;
   bool tumble = false;
   std::string inFileName;
@@ -53,6 +203,9 @@ int main(int argc, char** argv)
   SwitchArg<int> resolutionOpt(hwRes, {"-r", "--resolution"}, "Resolution (in DPI) to set in header");
   SwitchArg<int> resolutionXOpt(hwResX, {"-rx", "--resolution-x"}, "Resolution (in DPI) to set in header, x-axis");
   SwitchArg<int> resolutionYOpt(hwResY, {"-ry", "--resolution-y"}, "Resolution (in DPI) to set in header, y-axis");
+  SwitchArg<int> targetResolutionOpt(targetRes, {"-tr", "--target-resolution"}, "Downsample to this resolution (in DPI), must divide the input resolution");
+  SwitchArg<bool> decimateOpt(decimate, {"--decimate"}, "Downsample by dropping pixels rather than averaging");
+  SwitchArg<int> jobsOpt(jobs, {"-j", "--jobs"}, "Number of pages to encode in parallel");
   SwitchArg<bool> duplexOpt(duplex, {"-d", "--duplex"}, "Process for duplex printing");
   SwitchArg<bool> tumbleOpt(tumble, {"-t", "--tumble"}, "Process for tumbled duplex output");
   EnumSwitchArg<PrintParameters::BackXformMode> backXformOpt(params.backXformMode,
@@ -77,8 +230,8 @@ int main(int argc, char** argv)
 
   ArgGet args({&helpOpt, &verboseOpt, &formatOpt, &pagesOpt, &paperSizeOpt,
                &resolutionOpt, &resolutionXOpt, &resolutionYOpt,
-               &duplexOpt, &tumbleOpt, &backXformOpt, &qualityOpt,
-               &mediaPositionOpt, &mediaTypeOpt},
+               &targetResolutionOpt, &decimateOpt, &duplexOpt, &tumbleOpt, &backXformOpt, &qualityOpt,
+               &mediaPositionOpt, &mediaTypeOpt, &jobsOpt},
               {&inArg, &outArg},
               "Use \"-\" as filename for stdin/stdout.");
 
@@ -94,6 +247,12 @@ int main(int argc, char** argv)
     return 1;
   }
 
+  if(jobs < 1)
+  {
+    print_error("Number of jobs must be at least 1", args.argHelp());
+    return 1;
+  }
+
   if(verbose)
   {
     LogController::instance().enable(LogController::Debug);
@@ -128,6 +287,21 @@ int main(int argc, char** argv)
     params.hwResH = hwRes;
   }
 
+  size_t xFactor = 1;
+  size_t yFactor = 1;
+  if(targetResolutionOpt.isSet())
+  {
+    if(!downsample_factor(params.hwResW, targetRes, xFactor) ||
+       !downsample_factor(params.hwResH, targetRes, yFactor))
+    {
+      print_error("Target resolution must evenly divide the input resolution", args.argHelp());
+      return 1;
+    }
+    params.hwResW = targetRes;
+    params.hwResH = targetRes;
+  }
+  LineResampler::Mode resampleMode = decimate ? LineResampler::Decimate : LineResampler::BoxFilter;
+
   if(tumble)
   {
     params.duplexMode = PrintParameters::TwoSidedShortEdge;
@@ -148,108 +322,219 @@ int main(int argc, char** argv)
     fileHdr = make_pwg_file_hdr();
   }
 
-  size_t page = 0;
+  // Regular files are mapped and parsed in place, anything else is streamed
+  MappedInFile mappedFile(inFileName == "-" ? "" : inFileName);
+  std::optional<InBinFile> inFile;
+  if(!mappedFile)
+  {
+    inFile.emplace(inFileName);
+    if(!*inFile)
+    {
+      std::cerr << "Failed to open input" << std::endl;
+      return 1;
+    }
+  }
 
-  Bytestream outBts;
-  Bytestream bmpBts;
+  size_t page = 0;
 
-  InBinFile inFile(inFileName);
-  if(!inFile)
+  BufferedOutFile outFile(outFileName);
+  if(!outFile)
   {
-    std::cerr << "Failed to open input" << std::endl;
+    std::cerr << "Failed to open output" << std::endl;
     return 1;
   }
 
-  OutBinFile outFile(outFileName);
-
   outFile << fileHdr;
 
-  while(!inFile->eof())
-  {
-    outBts.reset();
-    page++;
-
-    std::string p;
-    std::string xs;
-    std::string ys;
-    std::string r;
-    inFile >> p;
-
-    ignore_comments(inFile);
+  // With several jobs, pages are encoded on worker threads while the following
+  // ones are being read, and a writer thread outputs them in the original order.
+  BoundedQueue<EncodeJob> workQueue(jobs * 2);
+  BoundedQueue<std::future<Bytestream>> resultQueue(jobs * 4);
+  std::atomic<bool> pipelineFailed = false;
+  List<LThread> workers;
+  LThread writer;
 
-    inFile >> xs >> ys;
-
-    if(p == "P6")
+  if(jobs > 1)
+  {
+    for(int i = 0; i < jobs; i++)
     {
-      inFile >> r;
-      if(r == "255")
+      workers.emplace_back();
+      workers.back().run([&]()
       {
-        params.colorMode = PrintParameters::sRGB24;
-      }
-      else if(r == "65535")
+        while(std::optional<EncodeJob> job = workQueue.pop())
+        {
+          try
+          {
+            job->result.set_value(encode_page(job->page, job->params, job->data,
+                                              xFactor, yFactor, resampleMode));
+          }
+          catch(...)
+          {
+            job->result.set_exception(std::current_exception());
+          }
+        }
+      });
+    }
+    writer.run([&]()
+    {
+      while(std::optional<std::future<Bytestream>> result = resultQueue.pop())
       {
-        params.colorMode = PrintParameters::sRGB48;
+        try
+        {
+          Bytestream outBts = result->get();
+          if(!pipelineFailed && !outFile.write(outBts))
+          {
+            std::cerr << "Failed to write output" << std::endl;
+            pipelineFailed = true;
+          }
+        }
+        catch(const std::exception& e)
+        {
+          std::cerr << "Failed to encode page: " << e.what() << std::endl;
+          pipelineFailed = true;
+        }
       }
-      else
+    });
+  }
+
+  auto outputPage = [&](PageData&& data) -> bool
+  {
+    if(jobs == 1)
+    {
+      Bytestream outBts = encode_page(page, params, data, xFactor, yFactor, resampleMode);
+      if(!outFile.write(outBts))
       {
-        std::cerr << "Only 255 and 65535 bit-depths supported, got " << r << std::endl;
-        return 1;
+        std::cerr << "Failed to write output" << std::endl;
+        return false;
       }
+      return true;
     }
-    else if(p == "P5")
+    EncodeJob job {page, params, std::move(data), {}};
+    resultQueue.push(job.result.get_future());
+    workQueue.push(std::move(job));
+    return !pipelineFailed;
+  };
+
+  auto convertPages = [&](auto& reader) -> bool
+  {
+    do
     {
-      inFile >> r;
-      if(r == "255")
+      page++;
+
+      std::string p = reader.token();
+      std::string xs = reader.token();
+      std::string ys = reader.token();
+      std::string r;
+
+      if(p == "P6")
+      {
+        r = reader.token();
+        if(r == "255")
+        {
+          params.colorMode = PrintParameters::sRGB24;
+        }
+        else if(r == "65535")
+        {
+          params.colorMode = PrintParameters::sRGB48;
+        }
+        else
+        {
+          std::cerr << "Only 255 and 65535 bit-depths supported, got " << r << std::endl;
+          return false;
+        }
+      }
+      else if(p == "P5")
       {
-        params.colorMode = PrintParameters::Gray8;
+        r = reader.token();
+        if(r == "255")
+        {
+          params.colorMode = PrintParameters::Gray8;
+        }
+        else if(r == "65535")
+        {
+          params.colorMode = PrintParameters::Gray16;
+        }
+        else
+        {
+          std::cerr << "Only 255 and 65535 bit-depths supported, got " << r << std::endl;
+          return false;
+        }
       }
-      else if(r == "65535")
+      else if(p == "P4")
       {
-        params.colorMode = PrintParameters::Gray16;
+        r = "1";
+        params.colorMode = PrintParameters::Black1;
+        size_t x = stoul(xs);
+        if(x % 8 != 0)
+        {
+          std::cerr << "Only whole-byte width P4 PBMs supported, got " << x << std::endl;
+          return false;
+        }
+        if(params.format == PrintParameters::URF)
+        {
+          std::cerr << "URF does not support 1-bit (P4/pbm) color." << std::endl;
+          return false;
+        }
       }
       else
       {
-        std::cerr << "Only 255 and 65535 bit-depths supported, got " << r << std::endl;
-        return 1;
+        std::cerr << "Only P4/P5/P6 (raw) supported, got " << p << std::endl;
+        return false;
       }
-    }
-    else if(p == "P4")
-    {
-      r = "1";
-      params.colorMode = PrintParameters::Black1;
-      size_t x = stoul(xs);
-      if(x % 8 != 0)
+
+      reader.endHeader();
+
+      DBG(<< "Found: " << p << " " << xs << "x" << ys << " " << r);
+
+      params.paperSizeW = stoul(xs);
+      params.paperSizeH = stoul(ys);
+
+      size_t size = params.paperSizeH*params.getPaperSizeWInBytes();
+      PageData data;
+      if(!reader.page(size, data))
       {
-        std::cerr << "Only whole-byte width P4 PBMs supported, got " << x << std::endl;
-        return 1;
+        std::cerr << "Unexpected end of input" << std::endl;
+        return false;
       }
-      if(params.format == PrintParameters::URF)
+
+      if(!outputPage(std::move(data)))
       {
-        std::cerr << "URF does not support 1-bit (P4/pbm) color." << std::endl;
-        return 1;
+        return false;
       }
     }
-    else
-    {
-      std::cerr << "Only P4/P5/P6 (raw) supported, got " << p << std::endl;
-      return 1;
-    }
+    while(!reader.atEnd());
+    return true;
+  };
 
-    ignore_comments(inFile);
-
-
-    DBG(<< "Found: " << p << " " << xs << "x" << ys << " " << r);
-
-    params.paperSizeW = stoul(xs);
-    params.paperSizeH = stoul(ys);
+  bool success = false;
+  if(mappedFile)
+  {
+    MappedPpmReader reader(mappedFile);
+    success = convertPages(reader);
+  }
+  else
+  {
+    StreamPpmReader reader(*inFile);
+    success = convertPages(reader);
+  }
 
-    size_t size = params.paperSizeH*params.getPaperSizeWInBytes();
-    bmpBts = Bytestream(inFile, size);
+  workQueue.close();
+  for(LThread& worker : workers)
+  {
+    worker.await();
+  }
+  resultQueue.close();
+  writer.await();
 
-    bmp_to_pwg(bmpBts, outBts, page, params);
+  if(!success || pipelineFailed)
+  {
+    return 1;
+  }
 
-    outFile << outBts;
-    inFile->peek(); // maybe trigger eof
+  if(!outFile.flush())
+  {
+    std::cerr << "Failed to write output" << std::endl;
+    return 1;
   }
   return 0;
 }
@@ -1,33 +1,59 @@
 #include <iostream>
 #include <fstream>
+#include <vector>
 
 #include "argget.h"
 #include "binfile.h"
+#include "list.h"
 #include "log.h"
 #include "pwg2ppm.h"
 #include "pwgpghdr.h"
+#include "resample.h"
 #include "urfpghdr.h"
+#include "workerpool.h"
 
 inline void print_error(const std::string& hint, const std::string& argHelp)
 {
   std::cerr << hint << std::endl << std::endl << argHelp << std::endl;
 }
 
+struct RasterPage
+{
+  size_t number = 0;
+  size_t width = 0;
+  size_t height = 0;
+  size_t colors = 0;
+  size_t bits = 0;
+  bool black = false;
+  size_t xFactor = 1;
+  size_t yFactor = 1;
+  size_t offset = 0;
+  size_t length = 0;
+};
+
 int main(int argc, char** argv)
 {
   bool help = false;
   bool verbose = false;
+  int targetRes = 0;
+  bool decimate = false;
+  int jobs = 1;
+  int thumbnailStep = 0;
 
   std::string inFileName;
   std::string outFilePrefix;
 
   SwitchArg<bool> helpOpt(help, {"-h", "--help"}, "Print this help text");
   SwitchArg<bool> verboseOpt(verbose, {"-v", "--verbose"}, "Be verbose, print headers");
+  SwitchArg<int> targetResolutionOpt(targetRes, {"-tr", "--target-resolution"}, "Downsample to this resolution (in DPI), must divide the input resolution");
+  SwitchArg<bool> decimateOpt(decimate, {"--decimate"}, "Downsample by dropping pixels rather than averaging");
+  SwitchArg<int> thumbnailOpt(thumbnailStep, {"--thumbnail"}, "Make thumbnails keeping every N:th line and pixel");
+  SwitchArg<int> jobsOpt(jobs, {"-j", "--jobs"}, "Number of pages to decode in parallel");
 
   PosArg inArg(inFileName, "in-file");
   PosArg outArg(outFilePrefix, "out-file prefix");
 
-  ArgGet args({&helpOpt, &verboseOpt},
+  ArgGet args({&helpOpt, &verboseOpt, &targetResolutionOpt, &decimateOpt, &thumbnailOpt, &jobsOpt},
               {&inArg, &outArg},
               "Use \"-\" as filename for stdin.");
 
@@ -43,11 +69,26 @@ int main(int argc, char** argv)
     return 1;
   }
 
+  if(jobs < 1)
+  {
+    print_error("Number of jobs must be at least 1", args.argHelp());
+    return 1;
+  }
+
+  if(thumbnailOpt.isSet() && (thumbnailStep < 1 || targetResolutionOpt.isSet()))
+  {
+    print_error("Thumbnail step must be at least 1, and can not be combined with a target resolution",
+                args.argHelp());
+    return 1;
+  }
+
   if(verbose)
   {
     LogController::instance().enable(LogController::Debug);
   }
 
+  LineResampler::Mode resampleMode = decimate ? LineResampler::Decimate : LineResampler::BoxFilter;
+
   InBinFile inFile(inFileName);
   if(!inFile)
   {
@@ -57,70 +98,123 @@ int main(int argc, char** argv)
   Bytestream file(inFile);
   DBG(<< "File is " << file.size() << " long");
 
-  size_t pages = 0;
-  Bytestream outBts;
+  bool urf = false;
 
   if(file >>= "RaS2")
   {
-
     DBG(<< "Smells like PWG Raster");
-
-    while(file.remaining())
-    {
-      DBG(<< "Page " << ++pages);
-      PwgPgHdr pwgHdr;
-      pwgHdr.decodeFrom(file);
-      DBG(<< pwgHdr.describe());
-      raster_to_bmp(outBts, file, pwgHdr.Width, pwgHdr.Height,
-                    pwgHdr.NumColors, pwgHdr.BitsPerColor, false);
-      write_ppm(outBts, pwgHdr.Width, pwgHdr.Height, pwgHdr.NumColors, pwgHdr.BitsPerColor,
-                pwgHdr.ColorSpace == PwgPgHdr::Black, outFilePrefix, pages);
-      outBts.reset();
-    }
   }
   else if(file >>= "UNIRAST")
   {
     uint32_t pageCount;
     file >> uint8_t{0} >> pageCount;
     DBG(<< "Smells like URF Raster, with " << pageCount << " pages");
+    urf = true;
+  }
+  else
+  {
+    std::cerr << "Unknown file format" << std::endl;
+    return 1;
+  }
 
-    while(file.remaining())
+  // Find all page boundaries up front, so the pages can be decoded independently
+  std::vector<RasterPage> pages;
+  while(file.remaining())
+  {
+    RasterPage page;
+    page.number = pages.size() + 1;
+    uint32_t resX = 0;
+    uint32_t resY = 0;
+    DBG(<< "Page " << page.number);
+
+    if(urf)
     {
-      DBG(<< "Page " << ++pages);
       UrfPgHdr urfHdr;
       urfHdr.decodeFrom(file);
       DBG(<< urfHdr.describe());
-      size_t colors = 0;
-      switch(urfHdr.ColorSpace)
+      page.width = urfHdr.Width;
+      page.height = urfHdr.Height;
+      page.colors = urf_colors(urfHdr.ColorSpace);
+      page.bits = urfHdr.BitsPerPixel/page.colors;
+      resX = resY = urfHdr.HWRes;
+    }
+    else
+    {
+      PwgPgHdr pwgHdr;
+      pwgHdr.decodeFrom(file);
+      DBG(<< pwgHdr.describe());
+      page.width = pwgHdr.Width;
+      page.height = pwgHdr.Height;
+      page.colors = pwgHdr.NumColors;
+      page.bits = pwgHdr.BitsPerColor;
+      page.black = pwgHdr.ColorSpace == PwgPgHdr::Black;
+      resX = pwgHdr.HWResolutionX;
+      resY = pwgHdr.HWResolutionY;
+    }
+
+    if(targetResolutionOpt.isSet() &&
+       (!downsample_factor(resX, targetRes, page.xFactor) ||
+        !downsample_factor(resY, targetRes, page.yFactor)))
+    {
+      std::cerr << "Can not downsample " << resX << "x" << resY << " to " << targetRes << std::endl;
+      return 1;
+    }
+
+    page.offset = file.pos();
+    skip_raster_page(file, page.width, page.height, page.colors, page.bits, urf);
+    page.length = file.pos() - page.offset;
+    pages.push_back(page);
+  }
+  DBG(<< "Total pages: " << pages.size());
+
+  WorkerPool pool(pages.size());
+
+  auto worker = [&]()
+  {
+    for(size_t i = 0; pool.next(i);)
+    {
+      const RasterPage& page = pages[i];
+      try
+      {
+        Bytestream pageBts(file.raw() + page.offset, page.length);
+        Bytestream bmpBts;
+        size_t width = page.width;
+        size_t height = page.height;
+        if(thumbnailOpt.isSet())
+        {
+          raster_to_thumbnail(bmpBts, pageBts, width, height, page.colors, page.bits, urf, thumbnailStep);
+          width = thumbnail_dimension(width, thumbnailStep);
+          height = thumbnail_dimension(height, thumbnailStep);
+        }
+        else
+        {
+          raster_to_bmp(bmpBts, pageBts, width, height, page.colors, page.bits, urf);
+        }
+        if(page.xFactor != 1 || page.yFactor != 1)
+        {
+          Bytestream smallBts;
+          downsample_bitmap(smallBts, bmpBts.raw(), width, height, page.colors, page.bits,
+                            page.xFactor, page.yFactor, resampleMode);
+          bmpBts = std::move(smallBts);
+          width /= page.xFactor;
+          height /= page.yFactor;
+        }
+        write_ppm(bmpBts, width, height, page.colors, page.bits, page.black,
+                  outFilePrefix, page.number);
+      }
+      catch(const std::exception& e)
       {
-        case UrfPgHdr::sGray:
-        case UrfPgHdr::Gray:
-          colors = 1;
-          break;
-        case UrfPgHdr::sRGB:
-        case UrfPgHdr::CieLab:
-        case UrfPgHdr::AdobeRGB:
-        case UrfPgHdr::RGB:
-          colors = 3;
-          break;
-        case UrfPgHdr::CMYK:
-          colors = 4;
-          break;
-        default:
-          throw std::logic_error("Unhandled color mode");
+        pool.addError("Page " + std::to_string(page.number) + ": " + e.what());
       }
-      size_t bitsPerColor = urfHdr.BitsPerPixel/colors;
-      raster_to_bmp(outBts, file, urfHdr.Width, urfHdr.Height, colors, bitsPerColor, true);
-      write_ppm(outBts, urfHdr.Width, urfHdr.Height, colors, bitsPerColor,
-                false, outFilePrefix, pages);
-      outBts.reset();
     }
-  }
-  else
+  };
+
+  pool.run(jobs, worker);
+
+  const List<std::string>& errors = pool.errors();
+  for(const std::string& error : errors)
   {
-    std::cerr << "Unknown file format" << std::endl;
-    return 1;
+    std::cerr << error << std::endl;
   }
-  DBG(<< "Total pages: " << pages);
-  return 0;
+  return errors.empty() ? 0 : 1;
 }